@@ -9,17 +9,6 @@
 
 
 
-void print_checksum(const World &world, const OutStream &stream)
-{
-    const uint32_t *checksum = static_cast<const uint32_t *>(stream.checksum());
-    std::printf("Time: %llu, Checksum:", (unsigned long long)world.current_time);
-    for(unsigned i = 0; i < Hash::result_size / 4; i++)
-        std::printf(" %08lX", (unsigned long)bswap32(checksum[i]));
-    std::printf("\n");
-}
-
-
-
 // Camera struct
 
 void Camera::update_scale()
@@ -505,7 +494,7 @@ GLuint load_texture(Image::Index id)
     return tex;
 }
 
-Representation::Representation(World &world, SDL_Window *window) : world(world), cam(window), move(t_none)
+Representation::Representation(World &world, SDL_Window *window) : world(world), cam(window), move(t_none), back(0)
 {
     prog[prog_food] = create_program("food", VertShader::food, FragShader::color);
     i_transform[prog_food] = glGetUniformLocation(prog[prog_food], "transform");
@@ -567,6 +556,7 @@ Representation::Representation(World &world, SDL_Window *window) : world(world),
 
 Representation::~Representation()
 {
+    world.finish_step();  // workers can write to snapshot
     for(int i = 0; i < prog_count; i++)glDeleteProgram(prog[i]);
     glDeleteVertexArrays(pass_count, arr);  glDeleteBuffers(buf_count, buf);
     glDeleteTextures(1, &tex_gui);  glDeleteTextures(1, &tex_panel);
@@ -725,7 +715,7 @@ bool Representation::select(int32_t x, int32_t y)
     uint64_t x0 = cam.x + std::lround(x * cam.scale);
     uint64_t y0 = cam.y + std::lround(y * cam.scale);
     uint32_t rad = std::min<long>(tile_size, world.config.base_radius + std::lround(click_zone * cam.scale));
-    sel.cr = world.hit_test({x0, y0}, rad, sel.id);
+    sel.set(world.hit_test({x0, y0}, rad, sel.id));
     if(!sel.cr)
     {
         if(sel.id == uint64_t(-1))return false;
@@ -739,22 +729,41 @@ bool Representation::select(int32_t x, int32_t y)
     fill_sel_bufs();  return true;
 }
 
-void Representation::update(SDL_Window *window, bool checksum, bool draw)
+void Representation::update_title(SDL_Window *window, uint64_t time, size_t food_count, size_t creature_count)
 {
-    world.count_objects();
-
     char title[256];
     snprintf(title, sizeof(title),
-        "Evolution - Time: %llu, Food: %lu, Creature: %lu", (unsigned long long)world.current_time,
-        (unsigned long)world.food_total(), (unsigned long)world.creature_total());
+        "Evolution - Time: %llu, Food: %lu, Creature: %lu", (unsigned long long)time,
+        (unsigned long)food_count, (unsigned long)creature_count);
     SDL_SetWindowTitle(window, title);
+}
 
-    if(checksum || !(world.current_time % 1000))
+void Representation::update_selection()
+{
+    sel.fill_sel_header(world.config, buf[inst_header], count[inst_header]);
+    sel.fill_sel_levels(buf[inst_level], count[inst_level]);
+    sel.fill_sel_limbs(buf[inst_sector], buf[inst_leg], count[inst_sector], count[inst_leg]);
+
+    if(sel.cr)
     {
-        OutStream stream;  stream.initialize();
-        stream << world;  stream.finalize();
-        print_checksum(world, stream);
+        cam.x += sel.cr->pos.x - sel.pos.x;
+        cam.y += sel.cr->pos.y - sel.pos.y;
+        sel.pos = sel.cr->pos;
     }
+}
+
+void Representation::print_checksum()
+{
+    OutStream stream;  stream.initialize();
+    stream << world;  stream.finalize();
+    ::print_checksum(world, stream);
+}
+
+void Representation::update(SDL_Window *window, bool checksum, bool draw)
+{
+    world.count_objects();
+    update_title(window, world.current_time, world.food_total(), world.creature_total());
+    if(checksum || !(world.current_time % 1000))print_checksum();
 
     if(!draw)return;
 
@@ -773,17 +782,8 @@ void Representation::update(SDL_Window *window, bool checksum, bool draw)
     glBufferData(GL_ARRAY_BUFFER, count[inst_attack] * sizeof(SectorData), nullptr, GL_STREAM_DRAW);
     if(count[inst_attack])attack_buf = static_cast<SectorData *>(glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY));
 
-    sel.cr = world.update(food_buf, creature_buf, attack_buf, sel.id);
-    sel.fill_sel_header(world.config, buf[inst_header], count[inst_header]);
-    sel.fill_sel_levels(buf[inst_level], count[inst_level]);
-    sel.fill_sel_limbs(buf[inst_sector], buf[inst_leg], count[inst_sector], count[inst_leg]);
-
-    if(sel.cr)
-    {
-        cam.x += sel.cr->pos.x - sel.pos.x;
-        cam.y += sel.cr->pos.y - sel.pos.y;
-        sel.pos = sel.cr->pos;
-    }
+    sel.set(world.update(food_buf, creature_buf, attack_buf, sel.id));
+    update_selection();
 
     if(food_buf)
     {
@@ -802,6 +802,60 @@ void Representation::update(SDL_Window *window, bool checksum, bool draw)
     }
 }
 
+void Representation::present(SDL_Window *window, Snapshot &snap)
+{
+    update_title(window, snap.time, snap.foods.size(), snap.creatures.size());
+
+    count[inst_food] = snap.foods.size();
+    glBindBuffer(GL_ARRAY_BUFFER, buf[inst_food]);
+    glBufferData(GL_ARRAY_BUFFER, count[inst_food] * sizeof(FoodData), snap.foods.data(), GL_STREAM_DRAW);
+
+    count[inst_creature] = snap.creatures.size();
+    glBindBuffer(GL_ARRAY_BUFFER, buf[inst_creature]);
+    glBufferData(GL_ARRAY_BUFFER, count[inst_creature] * sizeof(CreatureData), snap.creatures.data(), GL_STREAM_DRAW);
+
+    count[inst_attack] = snap.attacks.size();
+    glBindBuffer(GL_ARRAY_BUFFER, buf[inst_attack]);
+    glBufferData(GL_ARRAY_BUFFER, count[inst_attack] * sizeof(SectorData), snap.attacks.data(), GL_STREAM_DRAW);
+
+    std::swap(sel.state, snap.sel);  // found only if still alive
+    sel.cr = sel.state.id != uint64_t(-1) ? &sel.state : nullptr;
+    update_selection();
+}
+
+void Representation::step(SDL_Window *window, bool draw)  // presents previous step while the next one runs
+{
+    bool ready = world.finish_step();
+    if(ready && !(world.current_time % 1000))print_checksum();
+
+    Snapshot &cur = snapshot[back];  back ^= 1;
+    Snapshot &next = snapshot[back];
+    world.count_objects();
+    if(draw)
+    {
+        next.foods.resize(world.food_total());
+        next.creatures.resize(world.creature_total());
+        next.attacks.resize(world.attack_total());
+        next.time = world.current_time;  next.sel.id = -1;  next.valid = true;
+        world.start_step(next.foods.data(), next.creatures.data(), next.attacks.data(), sel.id, next.sel);
+    }
+    else
+    {
+        update_title(window, world.current_time, world.food_total(), world.creature_total());
+        next.valid = false;  world.start_step();
+    }
+
+    if(ready && cur.valid)present(window, cur);
+    cur.valid = false;
+}
+
+bool Representation::sync(SDL_Window *window, bool draw)  // should be called before accessing world
+{
+    if(!world.finish_step())return false;
+    snapshot[back].valid = false;
+    update(window, false, draw);  return true;
+}
+
 void Representation::draw()
 {
     glViewport(0, 0, cam.width, cam.height);
@@ -8,10 +8,7 @@
 #include <epoxy/gl.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
-
-
-
-void print_checksum(const World &world, const OutStream &stream);
+#include "video.h"
 
 
 
@@ -85,7 +82,8 @@ class Representation
     struct Selection
     {
         uint64_t id;
-        const Creature *cr;
+        const CreatureState *cr;  // points to state or null
+        CreatureState state;
         GenomeProcessor proc;
         std::vector<uint32_t> mapping[list_count];
         std::vector<uint32_t> input_mapping, refs;
@@ -97,6 +95,7 @@ class Representation
         {
         }
 
+        void set(const Creature *cr);
         void set_scroll(const Camera &cam, List list, int pos);
         void drag_scroll(const Camera &cam, List list, int base, int offs);
 
@@ -110,6 +109,21 @@ class Representation
     };
 
 
+    struct Snapshot  // draw data, filled by workers during the next step
+    {
+        std::vector<FoodData> foods;
+        std::vector<CreatureData> creatures;
+        std::vector<SectorData> attacks;
+        CreatureState sel;
+        uint64_t time;
+        bool valid;
+
+        Snapshot() : time(0), valid(false)
+        {
+        }
+    };
+
+
     static const PassInfo pass_info[pass_count];
 
     World &world;
@@ -120,6 +134,8 @@ class Representation
     size_t count[buf_count];
     int scroll_base, mouse_start;
     Selection sel;
+    Snapshot snapshot[2];
+    int back;  // snapshot being filled
 
 
     void fill_sel_bufs();
@@ -134,6 +150,11 @@ class Representation
     HitTest hit_test(int &x, int &y);
     bool select_slot(List list, int y);
 
+    void update_title(SDL_Window *window, uint64_t time, size_t food_count, size_t creature_count);
+    void update_selection();
+    void print_checksum();
+    void present(SDL_Window *window, Snapshot &snap);
+
 public:
     explicit Representation(World &world, SDL_Window *window);
     ~Representation();
@@ -146,5 +167,7 @@ public:
 
     bool select(int x, int y);
     void update(SDL_Window *window, bool checksum, bool draw);
+    void step(SDL_Window *window, bool draw);
+    bool sync(SDL_Window *window, bool draw);
     void draw();
 };
@@ -0,0 +1,384 @@
+// headless.cpp : entry point without rendering
+//
+
+#include "world.h"
+#include "shard.h"
+#include "stream.h"
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+struct Options
+{
+    uint64_t step_count, seed;
+    uint64_t checkpoint, report;
+    uint32_t world_count, process_count, thread_count, group_count, spin_count, split_size, rebalance;
+    uint8_t order;  bool pin, hilbert, wavefront;
+    const char *restart, *output;
+
+    Options() : step_count(1000), seed(1234), checkpoint(0), report(100),
+        world_count(1), process_count(0), thread_count(0), group_count(0), spin_count(-1), split_size(default_split_size), rebalance(default_rebalance_period), order(6), pin(false), hilbert(false), wavefront(false), restart(nullptr), output("default.save")
+    {
+    }
+
+    bool parse(char **args, int n);
+};
+
+bool parse_number(const char *str, uint64_t &val)
+{
+    char *end;  val = std::strtoull(str, &end, 10);
+    return *str && !*end;
+}
+
+bool Options::parse(char **args, int n)
+{
+    for(int i = 1; i < n; i++)
+    {
+        if(args[i][0] != '-')
+        {
+            if(restart)return false;
+            restart = args[i];  continue;
+        }
+        if(!args[i][1] || args[i][2] || i + 1 >= n)return false;
+
+        uint64_t val;  const char *arg = args[++i];
+        switch(args[i - 1][1])
+        {
+        case 'n':  if(!parse_number(arg, step_count))return false;  continue;
+        case 's':  if(!parse_number(arg, seed))return false;  continue;
+        case 'c':  if(!parse_number(arg, checkpoint))return false;  continue;
+        case 'r':  if(!parse_number(arg, report))return false;  continue;
+        case 'o':  output = arg;  continue;
+
+        case 'k':
+            if(!parse_number(arg, val) || !val || val > max_group_count)return false;
+            world_count = val;  continue;
+
+        case 'm':
+            if(!parse_number(arg, val) || val > max_group_count)return false;
+            process_count = val;  continue;
+
+        case 'j':
+            if(!parse_number(arg, val) || val > max_thread_count)return false;
+            thread_count = val;  continue;
+
+        case 'g':
+            if(!parse_number(arg, val) || val > max_group_count)return false;
+            group_count = val;  continue;
+
+        case 'w':
+            if(!parse_number(arg, val) || val >= uint32_t(-1))return false;
+            spin_count = val;  continue;
+
+        case 't':
+            if(!parse_number(arg, val) || val >= uint32_t(-1))return false;
+            split_size = val;  continue;
+
+        case 'b':
+            if(!parse_number(arg, val) || val > uint32_t(-1))return false;
+            rebalance = val;  continue;
+
+        case 'p':
+            if(!parse_number(arg, val) || val > 1)return false;
+            pin = val;  continue;
+
+        case 'l':
+            if(!parse_number(arg, val) || val > 1)return false;
+            hilbert = val;  continue;
+
+        case 'e':
+            if(!parse_number(arg, val) || val > 1)return false;
+            wavefront = val;  continue;
+
+        case 'z':
+            if(!parse_number(arg, val) || val < 2 || val >= 16)return false;
+            order = val;  continue;
+
+        default:
+            return false;
+        }
+    }
+    if(process_count && (world_count > 1 || pin || hilbert))return false;
+    return world_count == 1 || (!restart && !checkpoint && !pin);
+}
+
+void print_usage(const char *name)
+{
+    std::printf("Usage: %s [options] [restart file]\n"
+        "  -n <steps>     number of steps to run (default: 1000)\n"
+        "  -s <seed>      world generation seed (default: 1234)\n"
+        "  -z <order>     new world size, 2^order tiles per side (default: 6)\n"
+        "  -k <worlds>    run an ensemble of worlds with seeds from <seed> on one pool,\n"
+        "                 without restart, checkpoints and pinning (default: 1)\n"
+        "  -m <procs>     split the world into bands stepped by separate processes,\n"
+        "                 one thread each, without rebalancing (default: 0, disabled)\n"
+        "  -j <workers>   worker thread count, 0 to autodetect (default: 0)\n"
+        "  -g <groups>    tile group count, 0 for 4 per worker (default: 0)\n"
+        "  -w <spins>     idle spin iterations before parking (default: auto)\n"
+        "  -t <count>     creatures per part of hot tiles, 0 to disable (default: 64)\n"
+        "  -p <0|1>       pin workers to cpus, place groups on their nodes (default: 0)\n"
+        "  -l <0|1>       assign tiles to groups along Hilbert curve instead of rows,\n"
+        "                 not with -m (default: 0)\n"
+        "  -e <0|1>       overlap consecutive steps as a wavefront of tile groups (default: 0)\n"
+        "  -b <steps>     tile group rebalance interval, 0 to disable (default: 64)\n"
+        "  -c <steps>     checkpoint interval, 0 to disable (default: 0)\n"
+        "  -r <steps>     report interval, 0 to disable (default: 100)\n"
+        "  -o <file>      checkpoint file (default: default.save)\n", name);
+}
+
+
+bool load_restart(World &world, const char *path)
+{
+    InFileStream stream;
+    if(!stream.open(path))
+    {
+        std::printf("Cannot open restart file \"%s\"!\n", path);  return false;
+    }
+    stream >> world;
+    if(!stream.close())
+    {
+        std::printf("Invalid restart file \"%s\"!\n", path);  return false;
+    }
+    return true;
+}
+
+bool save_restart(World &world, const char *path)
+{
+    std::vector<char> temp(path, path + std::strlen(path));
+    temp.push_back('~');  temp.push_back('\0');
+
+    OutFileStream stream;
+    if(stream.open(temp.data()))
+    {
+        stream << world;
+        if(stream.close() && !std::rename(temp.data(), path))
+        {
+            print_checksum(world, stream);  return true;
+        }
+    }
+    std::printf("Cannot save restart \"%s\"!\n", path);  return false;
+}
+
+void print_checksum(World &world)
+{
+    OutStream stream;  stream.initialize();
+    stream << world;  stream.finalize();
+    print_checksum(world, stream);
+}
+
+void print_layout(const World &world)  // cross-tile buffers of both layouts
+{
+    uint32_t size_x = world.config.mask_x + 1, size_y = world.config.mask_y + 1;
+    TileLayout rows(size_x, size_y, world.group_count), curve(size_x, size_y, world.group_count, nullptr, true);
+    rows.build_layout();  curve.build_layout();
+    std::printf("Layout: Hilbert, Refs: %u, Rows: %u\n", curve.ref_total(), rows.ref_total());
+}
+
+void print_report(World &world, uint64_t steps, double time, uint64_t sync_time)
+{
+    world.count_objects();
+    std::printf("Time: %llu, Food: %lu, Creature: %lu, Steps/sec: %.2f, Sync: %.1f us/step\n",
+        (unsigned long long)world.current_time, (unsigned long)world.food_total(),
+        (unsigned long)world.creature_total(), time > 0 ? steps / time : 0.0,
+        1e-3 * sync_time / (steps * world.thread_count));
+    uint64_t fresh, reused, cached;  world.pool_counts(fresh, reused, cached);
+    std::printf("Pool: %llu new, %llu reused, %llu cached\n",
+        (unsigned long long)fresh, (unsigned long long)reused, (unsigned long long)cached);
+    uint64_t unique, genes;  GenomePool::instance().counts(unique, genes);
+    std::printf("Genomes: %llu unique, %llu genes, %.2f creatures per genome\n",
+        (unsigned long long)unique, (unsigned long long)genes, unique ? double(world.creature_total()) / unique : 0.0);
+    uint64_t hits, misses;  world.brains.counts(hits, misses);
+    std::printf("Brains: %llu hits, %llu misses\n", (unsigned long long)hits, (unsigned long long)misses);
+    std::printf("Scratch: %llu allocations\n", (unsigned long long)Scratch::alloc_count());
+    World::MemoryUsage usage;  world.memory_usage(usage);
+    const auto &mem = usage.world, &tile = usage.largest;
+    double n = std::max<uint64_t>(1, mem.creature_count);
+    std::printf("Memory: %.1f MiB, %.0f bytes per tile, %.1f bytes per food, brain cache %.1f MiB\n", mem.total() / 1048576.0,
+        double(mem.tiles) / std::max<uint64_t>(1, usage.tile_count), double(mem.foods) / std::max<uint64_t>(1, mem.food_count), mem.cache / 1048576.0);
+    std::printf("Creature: %.0f bytes (object %.0f, genome %.0f, brain %.0f, overhead %.0f)\n",
+        (mem.objects + mem.genomes + mem.brains + mem.overhead) / n, mem.objects / n, mem.genomes / n, mem.brains / n, mem.overhead / n);
+    std::printf("Largest tile: (%u, %u), %llu creatures, %llu foods, %.1f KiB "
+        "(objects %.1f, genomes %.1f, brains %.1f, overhead %.1f, foods %.1f, lists %.1f)\n",
+        usage.largest_tile & world.config.mask_x, usage.largest_tile >> world.config.order_x, (unsigned long long)tile.creature_count, (unsigned long long)tile.food_count, tile.total() / 1024.0,
+        tile.objects / 1024.0, tile.genomes / 1024.0, tile.brains / 1024.0, tile.overhead / 1024.0, tile.foods / 1024.0, tile.tiles / 1024.0);
+    if(!world.pin_threads)return;
+
+    uint64_t local, remote;  world.alloc_counts(local, remote);
+    std::printf("Allocations: %llu local, %llu remote\n", (unsigned long long)local, (unsigned long long)remote);
+}
+
+void print_report(Ensemble &ensemble, const std::vector<uint64_t> &last_steps, const std::vector<double> &last_elapsed, double time)
+{
+    uint64_t total = 0;
+    for(size_t k = 0; k < ensemble.worlds.size(); k++)
+    {
+        World &world = *ensemble.worlds[k];  world.count_objects();
+        uint64_t steps = ensemble.steps[k] - last_steps[k];  double elapsed = ensemble.elapsed[k] - last_elapsed[k];
+        std::printf("World %u: Time: %llu, Food: %lu, Creature: %lu, Steps/sec: %.2f\n", unsigned(k),
+            (unsigned long long)world.current_time, (unsigned long)world.food_total(),
+            (unsigned long)world.creature_total(), elapsed > 0 ? steps / elapsed : 0.0);
+        total += steps;
+    }
+    std::printf("Ensemble: %llu steps, Steps/sec: %.2f\n", (unsigned long long)total, time > 0 ? total / time : 0.0);
+}
+
+int run_ensemble(const Options &opt)
+{
+    Ensemble ensemble(opt.thread_count);
+    if(opt.spin_count != uint32_t(-1))ensemble.spin_count = opt.spin_count;
+    for(uint32_t k = 0; k < opt.world_count; k++)
+    {
+        World &world = ensemble.add(opt.group_count);
+        world.rebalance_period = opt.rebalance;  world.split_size = opt.split_size;  world.hilbert = opt.hilbert;
+        world.wavefront = opt.wavefront;  world.init(opt.seed + k, opt.order);
+    }
+    std::printf("Workers: %u, Worlds: %u, Groups: %u, Spins: %u\n", ensemble.thread_count,
+        opt.world_count, ensemble.worlds[0]->group_count, ensemble.spin_count);
+
+    ensemble.start();
+    Clock::time_point start = Clock::now(), last = start;
+    std::vector<uint64_t> last_steps(opt.world_count, 0);
+    std::vector<double> last_elapsed(opt.world_count, 0);
+    for(uint64_t step = 0; step < opt.step_count;)
+    {
+        uint64_t n = opt.step_count - step;
+        if(opt.report)n = std::min(n, opt.report - step % opt.report);
+        ensemble.run(n);  step += n;
+
+        if(opt.report && !(step % opt.report))
+        {
+            Clock::time_point cur = Clock::now();
+            print_report(ensemble, last_steps, last_elapsed, std::chrono::duration<double>(cur - last).count());
+            last = cur;  last_steps = ensemble.steps;  last_elapsed = ensemble.elapsed;
+        }
+    }
+    double total = std::chrono::duration<double>(Clock::now() - start).count();
+    ensemble.stop();
+
+    for(auto &world : ensemble.worlds)print_checksum(*world);
+    uint64_t steps = opt.step_count * opt.world_count;
+    std::printf("Total: %llu steps in %.3f sec, %.2f steps/sec\n",
+        (unsigned long long)steps, total, total > 0 ? steps / total : 0.0);
+    return 0;
+}
+
+
+bool save_restart(Shard &shard, const char *path)  // rank 0 writes, others only send data
+{
+    if(!shard.gather(true))return false;
+    if(shard.rank)return true;
+
+    std::vector<char> temp(path, path + std::strlen(path));
+    temp.push_back('~');  temp.push_back('\0');
+
+    OutFileStream stream;
+    if(stream.open(temp.data()))
+    {
+        shard.save(stream);
+        if(stream.close() && !std::rename(temp.data(), path))
+        {
+            print_checksum(shard.world, stream);  return true;
+        }
+    }
+    std::printf("Cannot save restart \"%s\"!\n", path);  return false;
+}
+
+int run_shard(const Options &opt)
+{
+    World world(1, opt.process_count);
+    if(!opt.restart)world.init(opt.seed, opt.order);
+    else if(!load_restart(world, opt.restart))return -1;
+    std::printf("Processes: %u\n", opt.process_count);
+    print_checksum(world);
+
+    Shard shard(world);
+    if(!shard.start(opt.process_count))
+    {
+        if(!shard.rank)std::printf("Cannot split world into %u bands!\n", opt.process_count);
+        shard.stop();  return -1;
+    }
+
+    Clock::time_point start = Clock::now(), last = start;
+    bool res = true;
+    for(uint64_t step = 1; res && step <= opt.step_count; step++)
+    {
+        res = shard.step();
+        if(res && opt.report && !(step % opt.report) && (res = shard.gather(false)) && !shard.rank)
+        {
+            Clock::time_point cur = Clock::now();  double time = std::chrono::duration<double>(cur - last).count();
+            std::printf("Time: %llu, Food: %llu, Creature: %llu, Steps/sec: %.2f\n",
+                (unsigned long long)world.current_time, (unsigned long long)shard.food_total,
+                (unsigned long long)shard.creature_total, time > 0 ? opt.report / time : 0.0);
+            last = cur;
+        }
+        if(res && opt.checkpoint && !(step % opt.checkpoint))res = save_restart(shard, opt.output);
+    }
+    double total = std::chrono::duration<double>(Clock::now() - start).count();
+    if(res && (res = shard.gather(true)) && !shard.rank)
+    {
+        OutStream stream;  stream.initialize();
+        shard.save(stream);  stream.finalize();
+        print_checksum(world, stream);
+        std::printf("Total: %llu steps in %.3f sec, %.2f steps/sec\n",
+            (unsigned long long)opt.step_count, total, total > 0 ? opt.step_count / total : 0.0);
+    }
+    if(!res && !shard.rank)std::printf("Process exchange failed!\n");
+    return shard.stop() && res ? 0 : -1;
+}
+
+
+int main(int n, char **args)
+{
+    Options opt;
+    if(!opt.parse(args, n))
+    {
+        print_usage(args[0]);  return -1;
+    }
+    if(opt.world_count > 1)return run_ensemble(opt);
+    if(opt.process_count)return run_shard(opt);
+
+    World world(opt.thread_count, opt.group_count);
+    if(opt.spin_count != uint32_t(-1))world.spin_count = opt.spin_count;
+    world.rebalance_period = opt.rebalance;  world.pin_threads = opt.pin;  world.split_size = opt.split_size;
+    world.hilbert = opt.hilbert;  world.wavefront = opt.wavefront;
+    if(!opt.restart)world.init(opt.seed, opt.order);
+    else if(!load_restart(world, opt.restart))return -1;
+    std::printf("Workers: %u, Groups: %u, Spins: %u\n", world.thread_count, world.group_count, world.spin_count);
+    if(opt.hilbert)print_layout(world);
+    print_checksum(world);
+
+    world.start();
+    Clock::time_point start = Clock::now(), last = start;
+    uint64_t last_step = 0, last_sync = 0;
+    for(uint64_t step = 0; step < opt.step_count;)
+    {
+        uint64_t n = opt.step_count - step;  // run up to the next report or checkpoint
+        if(opt.report)n = std::min(n, opt.report - step % opt.report);
+        if(opt.checkpoint)n = std::min(n, opt.checkpoint - step % opt.checkpoint);
+        step += world.run(n);
+
+        if(opt.report && !(step % opt.report))
+        {
+            Clock::time_point cur = Clock::now();  uint64_t sync = world.sync_time();
+            print_report(world, step - last_step, std::chrono::duration<double>(cur - last).count(), sync - last_sync);
+            last = cur;  last_step = step;  last_sync = sync;
+        }
+        if(opt.checkpoint && !(step % opt.checkpoint) && !save_restart(world, opt.output))
+        {
+            world.stop();  return -1;
+        }
+    }
+    double total = std::chrono::duration<double>(Clock::now() - start).count();
+    uint64_t sync = world.sync_time();  world.stop();
+
+    print_checksum(world);
+    std::printf("Total: %llu steps in %.3f sec, %.2f steps/sec, Sync: %.1f us/step\n",
+        (unsigned long long)opt.step_count, total, total > 0 ? opt.step_count / total : 0.0,
+        opt.step_count ? 1e-3 * sync / (opt.step_count * world.thread_count) : 0.0);
+    return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "graph.h"
 #include "stream.h"
+#include <cstdlib>
 
 
 
@@ -59,14 +60,37 @@ bool save_restart(World &world)
     std::printf("Cannot save restart!\n");  return false;
 }
 
+bool parse_args(char **args, int n, uint32_t &thread_count, const char *&restart)
+{
+    thread_count = 0;  restart = nullptr;
+    for(int i = 1; i < n; i++)
+    {
+        if(!std::strcmp(args[i], "-j") && i + 1 < n)
+        {
+            char *end;  unsigned long val = std::strtoul(args[++i], &end, 10);
+            if(!*args[i] || *end || val > max_thread_count)return false;
+            thread_count = val;  continue;
+        }
+        if(args[i][0] == '-' || restart)return false;
+        restart = args[i];
+    }
+    return true;
+}
+
 bool main_loop(SDL_Window *window, char **args, int n)
 {
     glEnable(GL_FRAMEBUFFER_SRGB);  glEnable(GL_MULTISAMPLE);
     glEnable(GL_CULL_FACE);
 
-    World world(8);
-    if(n <= 1)world.init();
-    else if(!load_restart(world, args[1]))return false;
+    uint32_t thread_count;  const char *restart;
+    if(!parse_args(args, n, thread_count, restart))
+    {
+        std::printf("Usage: %s [-j <workers>] [restart file]\n", args[0]);  return false;
+    }
+
+    World world(thread_count);
+    if(!restart)world.init();
+    else if(!load_restart(world, restart))return false;
     Representation graph(world, window);
 
     world.start();
@@ -80,10 +104,7 @@ bool main_loop(SDL_Window *window, char **args, int n)
         if(!update)SDL_WaitEvent(&evt);
         else if(!SDL_PollEvent(&evt))
         {
-            if(play)
-            {
-                world.next_step();  graph.update(window, false, active);
-            }
+            if(play)graph.step(window, active);
             if(active)
             {
                 graph.draw();
@@ -95,6 +116,7 @@ bool main_loop(SDL_Window *window, char **args, int n)
         switch(evt.type)
         {
         case SDL_MOUSEBUTTONDOWN:
+            graph.sync(window, active);
             if(graph.mouse_down(evt.button))break;
             continue;
 
@@ -120,7 +142,7 @@ bool main_loop(SDL_Window *window, char **args, int n)
                 active = false;  continue;
 
             case SDL_WINDOWEVENT_RESTORED:
-                graph.update(window, false, true);
+                if(!graph.sync(window, true))graph.update(window, false, true);
                 active = true;  break;
 
             default:
@@ -132,14 +154,16 @@ bool main_loop(SDL_Window *window, char **args, int n)
             switch(evt.key.keysym.sym)
             {
             case SDLK_SPACE:
+                graph.sync(window, active);
                 update = play = !play;  continue;
 
             case SDLK_RIGHT:
-                world.next_step();
+                graph.sync(window, false);  world.next_step();
                 graph.update(window, true, true);
                 play = false;  break;
 
             case SDLK_F5:
+                graph.sync(window, active);
                 save_restart(world);  break;
 
             default:
@@ -8,6 +8,12 @@
 
 // Representation::Selection struct
 
+void Representation::Selection::set(const Creature *cr)
+{
+    if(cr)state.set(*cr);
+    Selection::cr = cr ? &state : nullptr;
+}
+
 void Representation::Selection::set_scroll(const Camera &cam, List list, int pos)
 {
     int list_height = cam.height - Gui::header_height;
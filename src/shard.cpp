@@ -0,0 +1,420 @@
+// shard.cpp : multi-process simulation, one band of tile rows per process
+//
+
+#include "shard.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+
+
+// Shard struct
+
+Shard::Shard(World &world) : world(world), rank(0), rank_count(1), first_tile(0), last_tile(0),
+    food_total(0), creature_total(0)
+{
+}
+
+Shard::~Shard()
+{
+    for(auto &peer : peers)if(peer.fd >= 0)close(peer.fd);
+}
+
+
+bool Shard::start(uint32_t rank_count)  // world should be initialized with a group per process
+{
+    uint32_t size = world.layout.size(), size_y = 1u << world.config.order_y;
+    if(world.groups.size() != rank_count || size_y % rank_count)return false;
+
+    Shard::rank_count = rank_count;
+    std::vector<int> fds(rank_count * rank_count, -1);  // fds[i * n + j]: end of rank i
+    for(uint32_t i = 0; i < rank_count; i++)for(uint32_t j = i + 1; j < rank_count; j++)
+    {
+        int pair[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+        {
+            for(int fd : fds)if(fd >= 0)close(fd);
+            return false;
+        }
+        fds[i * rank_count + j] = pair[0];  fds[j * rank_count + i] = pair[1];
+    }
+
+    std::fflush(stdout);  // otherwise buffered output gets duplicated
+    for(rank = 1; rank < rank_count; rank++)
+    {
+        pid_t pid = fork();
+        if(!pid)break;
+        if(pid < 0)
+        {
+            std::printf("Cannot start process %u!\n", rank);
+            rank_count = rank;  break;  // started ones fail on the closed sockets
+        }
+        children.push_back(pid);
+    }
+    if(rank >= rank_count)rank = 0;
+    else children.clear();
+
+    peers.resize(Shard::rank_count);
+    for(uint32_t i = 0; i < fds.size(); i++)if(fds[i] >= 0 && i / Shard::rank_count != rank)close(fds[i]);
+    for(uint32_t i = 0; i < peers.size(); i++)
+    {
+        int fd = peers[i].fd = fds[rank * Shard::rank_count + i];
+        if(fd >= 0)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    if(rank_count != Shard::rank_count)return false;
+    streams.resize(rank_count);
+
+    uint32_t band = size / rank_count;
+    first_tile = rank * band;  last_tile = first_tile + band;
+    buf.resize(std::max<uint32_t>(1, world.config.slot_bits >> 6));
+
+    for(uint32_t i = 0; i < size; i++)  // drop what other processes own
+        if(owner(i) != rank && !is_halo(i))world.get_tile(i).clear();
+    for(uint32_t i = 0; i < rank_count; i++)if(i != rank)world.groups[i].free_deleted();
+    return true;
+}
+
+bool Shard::step()
+{
+    const Config &config = world.config;
+    world.groups[rank].collect_credits(config, world.layout, world.groups);
+    world.groups[rank].execute_step(config, world.brains);
+
+    begin_round();  send_migrants();  uint64_t total;
+    if(!end_round() || !recv_migrants(total))return false;
+    for(uint32_t i = first_tile; i < last_tile; i++)world.get_tile(i).consolidate(world.groups);
+    for(auto &group : world.groups)group.next_id += total;
+
+    begin_round();  send_halo();
+    if(!end_round() || !recv_halo())return false;
+    for(uint32_t i = first_tile; i < last_tile; i++)
+        world.get_tile(i).process_detectors(config, world.layout, world.groups);
+    for(uint32_t i = first_tile; i < last_tile; i++)  // credits of halo creatures are sent right away
+    {
+        const Tile &tile = world.get_tile(i);
+        for(uint32_t k = 0; k < tile.credits.size(); k++)
+        {
+            uint32_t x = (tile.x + k % 3 - 1) & config.mask_x, y = (tile.y + k % 9 / 3 - 1) & config.mask_y;
+            if(owner(x | (y << config.order_x)) == rank)continue;
+            for(auto &credit : tile.credits[k])credit.target->food_energy += config.food_energy;
+        }
+    }
+
+    begin_round();  send_credits();
+    if(!end_round() || !recv_credits())return false;
+    world.current_time++;  return true;
+}
+
+bool Shard::gather(bool tiles)
+{
+    uint64_t foods = 0, creatures = 0;
+    for(uint32_t i = first_tile; i < last_tile; i++)
+    {
+        const Tile &tile = world.get_tile(i);
+        foods += tile.food_count;  creatures += tile.creature_count;
+    }
+
+    begin_round();
+    if(rank)
+    {
+        *streams[0] << foods << creatures;
+        if(tiles)world.save_tiles(*streams[0], first_tile, last_tile);
+    }
+    if(!end_round())return false;
+    if(rank)return true;
+
+    food_total = foods;  creature_total = creatures;
+    for(uint32_t i = 1; i < rank_count; i++)
+    {
+        InMemoryStream stream(peers[i].in.data() + 8, peers[i].in.size() - 8);
+        stream >> foods >> creatures;  if(!stream)return false;
+        food_total += foods;  creature_total += creatures;
+    }
+    return true;
+}
+
+void Shard::save(OutStream &stream) const  // tile data of other processes follows their counts
+{
+    assert(!rank);
+    world.save_header(stream);  world.save_tiles(stream, first_tile, last_tile);
+    for(uint32_t i = 1; i < rank_count; i++)stream.put(peers[i].in.data() + 24, peers[i].in.size() - 24);
+}
+
+bool Shard::stop()  // false if any other process failed
+{
+    for(auto &peer : peers)if(peer.fd >= 0)
+    {
+        close(peer.fd);  peer.fd = -1;
+    }
+    bool res = true;
+    for(pid_t pid : children)
+    {
+        int status;
+        if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))res = false;
+    }
+    children.clear();  return res;
+}
+
+
+uint32_t Shard::owner(uint32_t tile) const
+{
+    return tile / (world.layout.size() / rank_count);
+}
+
+bool Shard::is_halo(uint32_t tile) const  // tile of other process next to own band
+{
+    uint32_t row = 1u << world.config.order_x, mask = world.layout.size() - 1;
+    if(owner(tile) == rank)return false;
+    return (tile + row & mask) - first_tile < last_tile - first_tile || (tile - row & mask) - first_tile < last_tile - first_tile;
+}
+
+void Shard::begin_round()
+{
+    for(uint32_t i = 0; i < rank_count; i++)
+    {
+        streams[i].reset(i == rank ? nullptr : new OutMemoryStream);
+        if(streams[i])streams[i]->data.resize(8);  // size header
+    }
+}
+
+bool Shard::end_round()
+{
+    for(uint32_t i = 0; i < rank_count; i++)if(streams[i])
+    {
+        streams[i]->finalize();  peers[i].out.swap(streams[i]->data);
+    }
+    return exchange();
+}
+
+bool Shard::exchange()  // sends a message to every peer and receives one from every peer
+{
+    for(auto &peer : peers)if(peer.fd >= 0)
+    {
+        uint64_t size = peer.out.size() - 8;  std::memcpy(peer.out.data(), &size, 8);
+        peer.out_pos = peer.in_pos = 0;  peer.in.resize(8);
+    }
+
+    std::vector<pollfd> fds;  std::vector<uint32_t> index;
+    for(;;)
+    {
+        fds.clear();  index.clear();
+        for(uint32_t i = 0; i < rank_count; i++)
+        {
+            const Peer &peer = peers[i];  if(peer.fd < 0)continue;
+            short events = (peer.out_pos < peer.out.size() ? POLLOUT : 0) | (peer.in_pos < peer.in.size() ? POLLIN : 0);
+            if(!events)continue;
+            fds.push_back(pollfd{peer.fd, events, 0});  index.push_back(i);
+        }
+        if(fds.empty())return true;
+        if(poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if(errno == EINTR)continue;  return false;
+        }
+
+        for(size_t i = 0; i < fds.size(); i++)
+        {
+            Peer &peer = peers[index[i]];
+            if(fds[i].revents & (POLLOUT | POLLERR) && peer.out_pos < peer.out.size())
+            {
+                ssize_t n = send(peer.fd, peer.out.data() + peer.out_pos, peer.out.size() - peer.out_pos, MSG_NOSIGNAL);
+                if(n < 0 && errno != EAGAIN && errno != EINTR)return false;
+                if(n > 0)peer.out_pos += n;
+            }
+            if(fds[i].revents & (POLLIN | POLLHUP | POLLERR) && peer.in_pos < peer.in.size())
+            {
+                ssize_t n = recv(peer.fd, peer.in.data() + peer.in_pos, peer.in.size() - peer.in_pos, 0);
+                if(!n || n < 0 && errno != EAGAIN && errno != EINTR)return false;  // peer exited
+                if(n > 0 && (peer.in_pos += n) == 8)
+                {
+                    uint64_t size;  std::memcpy(&size, peer.in.data(), 8);  peer.in.resize(8 + size);
+                }
+            }
+        }
+    }
+}
+
+
+void Shard::send_migrants()  // children count and buffers for other bands, sent creatures are freed
+{
+    TileGroup &group = world.groups[rank];
+    uint64_t children = 0;
+    for(auto &tile : group.tiles)children += tile.children_count;
+    for(auto &stream : streams)if(stream)*stream << children;
+
+    for(uint32_t k = 0; k < group.buffers.size(); k++)
+    {
+        uint32_t dst = owner(group.targets[k]);  if(dst == rank)continue;
+        auto &buffer = group.buffers[k];  OutMemoryStream &stream = *streams[dst];
+        stream << k << uint32_t(buffer.foods.size()) << buffer.food_count << buffer.creature_count;
+        stream << uint32_t(buffer.sources.size());
+        for(auto &src : buffer.sources)stream << src.tile << src.food_end << src.creature_end;
+        for(auto &food : buffer.foods)stream << food;
+
+        stream << align(8);
+        for(Creature *cr : buffer.creatures)
+        {
+            cr->save(stream, buf.data());  delete cr;  // no longer referenced as father
+        }
+        buffer.clear();
+    }
+    for(auto &stream : streams)if(stream)*stream << uint32_t(-1);
+}
+
+bool Shard::recv_migrants(uint64_t &total)  // also assigns id offsets to own tiles
+{
+    const Config &config = world.config;
+    uint64_t next_id = world.groups[rank].next_id, offset = next_id;  total = 0;
+    for(uint32_t src = 0; src < rank_count; src++)
+    {
+        uint64_t children = 0;
+        if(src == rank)
+        {
+            for(auto &tile : world.groups[rank].tiles)children += tile.children_count;
+            total += children;  continue;
+        }
+
+        InMemoryStream stream(peers[src].in.data() + 8, peers[src].in.size() - 8);
+        stream >> children;  if(src < rank)offset += children;  total += children;
+        for(;;)
+        {
+            uint32_t k;  stream >> k;
+            if(!stream || k >= world.groups[src].buffers.size())
+            {
+                if(stream && k == uint32_t(-1))break;  return false;
+            }
+
+            auto &buffer = world.groups[src].buffers[k];
+            const Tile &tile = world.get_tile(world.groups[src].targets[k]);
+            uint64_t offs_x = uint64_t(tile.x) << tile_order;
+            uint64_t offs_y = uint64_t(tile.y) << tile_order;
+
+            uint32_t n, count, sources;  stream >> n >> buffer.food_count >> count >> sources;
+            if(!stream || sources > 9)return false;
+            buffer.sources.resize(sources);  uint32_t food_end = 0, creature_end = 0;
+            for(auto &src : buffer.sources)
+            {
+                stream >> src.tile >> src.food_end >> src.creature_end;
+                if(!stream || src.food_end < food_end || src.creature_end < creature_end)return false;
+                food_end = src.food_end;  creature_end = src.creature_end;
+            }
+            if(food_end != n || creature_end != count)return false;
+            buffer.foods.resize(n);
+            for(auto &food : buffer.foods)if(!food.load(config, stream, offs_x, offs_y))return false;
+
+            stream >> align(8);  buffer.creatures.clear();
+            buffer.creature_count = buffer.attack_count = 0;
+            for(uint32_t i = 0; i < count; i++)
+            {
+                Creature *cr = Creature::load(config, stream, next_id, buf.data());
+                if(!cr)return false;
+                cr->pos.x |= offs_x;  cr->pos.y |= offs_y;  buffer.append(cr);
+            }
+        }
+    }
+
+    for(uint32_t i = first_tile; i < last_tile; i++)  // same order as Context::assign_ids()
+    {
+        Tile &tile = world.get_tile(i);
+        tile.id_offset = offset;  offset += tile.children_count;
+    }
+    return true;
+}
+
+void Shard::save_halo(OutStream &stream, uint32_t index) const
+{
+    const Tile &tile = world.get_tile(index);
+    stream << index << tile.spawn_start << uint32_t(tile.foods.size()) << tile.food_count << tile.creature_count;
+    for(auto &food : tile.foods)stream << food;
+
+    stream << align(8);
+    for(const Creature *cr : tile.creatures)cr->save(stream, buf.data());
+}
+
+void Shard::send_halo()  // consolidated boundary rows for detectors of other bands
+{
+    uint32_t row = 1u << world.config.order_x, mask = world.layout.size() - 1;
+    uint32_t up = owner(first_tile - row & mask), down = owner(last_tile & mask);
+    for(uint32_t i = first_tile; i < last_tile; i++)
+    {
+        bool top = i < first_tile + row && up != rank;
+        if(top)save_halo(*streams[up], i);
+        if(i >= last_tile - row && down != rank && !(top && down == up))save_halo(*streams[down], i);
+    }
+    for(auto &stream : streams)if(stream)*stream << uint32_t(-1);
+}
+
+bool Shard::recv_halo()  // previous halo creatures are no longer referenced as fathers
+{
+    const Config &config = world.config;
+    uint64_t next_id = world.groups[rank].next_id;
+    for(uint32_t src = 0; src < rank_count; src++)if(src != rank)
+    {
+        InMemoryStream stream(peers[src].in.data() + 8, peers[src].in.size() - 8);
+        for(;;)
+        {
+            uint32_t i;  stream >> i;
+            if(!stream || i >= world.layout.size() || owner(i) != src || !is_halo(i))
+            {
+                if(stream && i == uint32_t(-1))break;  return false;
+            }
+
+            Tile &tile = world.get_tile(i);  tile.clear();
+            uint64_t offs_x = uint64_t(tile.x) << tile_order;
+            uint64_t offs_y = uint64_t(tile.y) << tile_order;
+
+            uint32_t n, count;  stream >> tile.spawn_start >> n >> tile.food_count >> count;
+            if(!stream || tile.spawn_start > n)return false;
+            tile.foods.resize(n);
+            for(auto &food : tile.foods)if(!food.load(config, stream, offs_x, offs_y))return false;
+
+            stream >> align(8);
+            for(uint32_t k = 0; k < count; k++)
+            {
+                Creature *cr = Creature::load(config, stream, next_id, buf.data());
+                if(!cr)return false;
+                cr->pos.x |= offs_x;  cr->pos.y |= offs_y;  tile.append(cr);
+            }
+            tile.targets.assign(tile.creatures);
+        }
+    }
+    return true;
+}
+
+void Shard::send_credits()  // energy of food eaten by halo creatures
+{
+    for(uint32_t i = 0; i < world.layout.size(); i++)if(is_halo(i))
+    {
+        const Tile &tile = world.get_tile(i);
+        for(uint32_t index = 0; index < tile.creatures.size(); index++)
+        {
+            const Creature *cr = tile.creatures[index];
+            if(cr->food_energy)*streams[owner(i)] << i << index << cr->food_energy;
+        }
+    }
+    for(auto &stream : streams)if(stream)*stream << uint32_t(-1);
+}
+
+bool Shard::recv_credits()
+{
+    for(uint32_t src = 0; src < rank_count; src++)if(src != rank)
+    {
+        InMemoryStream stream(peers[src].in.data() + 8, peers[src].in.size() - 8);
+        for(;;)
+        {
+            uint32_t i, index;  stream >> i;
+            if(!stream || i >= world.layout.size() || owner(i) != rank)
+            {
+                if(stream && i == uint32_t(-1))break;  return false;
+            }
+
+            uint64_t energy;  stream >> index >> energy;
+            const auto &creatures = world.get_tile(i).creatures;
+            if(!stream || index >= creatures.size())return false;
+            creatures[index]->food_energy += energy;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+// shard.h : multi-process simulation, one band of tile rows per process
+//
+
+#pragma once
+
+#include "world.h"
+#include "stream.h"
+#include <sys/types.h>
+
+
+
+struct Shard  // steps own band in a single thread, exchanges boundaries with the other processes
+{
+    typedef TileGroup::Tile Tile;
+
+    struct Peer
+    {
+        int fd;
+        std::vector<char> out, in;  // messages with 8-byte size header
+        size_t out_pos, in_pos;
+    };
+
+
+    World &world;
+    uint32_t rank, rank_count;
+    uint32_t first_tile, last_tile;  // own band, equals own group
+    std::vector<Peer> peers;
+    std::vector<std::unique_ptr<OutMemoryStream>> streams;  // messages in preparation
+    std::vector<pid_t> children;
+    mutable std::vector<uint64_t> buf;
+    uint64_t food_total, creature_total;  // after gather()
+
+
+    explicit Shard(World &world);
+    ~Shard();
+
+    bool start(uint32_t rank_count);  // forks, returns in every process
+    bool step();
+    bool gather(bool tiles);  // counts and optionally tile data at rank 0
+    void save(OutStream &stream) const;  // rank 0 only, after gather(true)
+    bool stop();
+
+    uint32_t owner(uint32_t tile) const;
+    bool is_halo(uint32_t tile) const;
+    void begin_round();
+    bool end_round();
+    bool exchange();
+
+    void send_migrants();
+    bool recv_migrants(uint64_t &total);
+    void save_halo(OutStream &stream, uint32_t index) const;
+    void send_halo();
+    bool recv_halo();
+    void send_credits();
+    bool recv_credits();
+};
@@ -2,6 +2,7 @@
 //
 
 #include "stream.h"
+#include <algorithm>
 
 
 
@@ -159,3 +160,22 @@ bool InFileStream::close()
     bool res = !std::fclose(file) && finalize(checksum);
     file = nullptr;  return res;
 }
+
+
+
+// OutMemoryStream class
+
+void OutMemoryStream::overflow(const char *data, size_t size, bool last)
+{
+    OutMemoryStream::data.insert(OutMemoryStream::data.end(), data, data + size);
+}
+
+
+
+// InMemoryStream class
+
+size_t InMemoryStream::underflow(char *buf, size_t size)
+{
+    size_t n = std::min(size, left), res = left;
+    std::memcpy(buf, data, n);  data += n;  left -= n;  return res;
+}
@@ -295,3 +295,35 @@ public:
     bool open(const char *path);
     bool close();
 };
+
+
+class OutMemoryStream : public OutStream  // appends to data, checksum not included
+{
+protected:
+    void overflow(const char *data, size_t size, bool last) final;
+
+public:
+    std::vector<char> data;
+
+    explicit OutMemoryStream(size_t size = 1ul << 12) : OutStream(size)
+    {
+        initialize();
+    }
+};
+
+
+class InMemoryStream : public InStream
+{
+    const char *data;
+    size_t left;
+
+protected:
+    size_t underflow(char *buf, size_t size) final;
+
+public:
+    InMemoryStream(const char *data, size_t size, size_t buf_size = 1ul << 12) :
+        InStream(buf_size), data(data), left(size)
+    {
+        initialize();
+    }
+};
@@ -133,12 +133,12 @@ struct FoodData
 {
     GLfloat x, y, rad, type;
 
-    void set(const Config &config, const Food &food)
+    void set(const Config &config, Food::Type food_type, const Position &pos)
     {
-        x = food.pos.x * draw_scale;
-        y = food.pos.y * draw_scale;
+        x = pos.x * draw_scale;
+        y = pos.y * draw_scale;
         rad = config.base_radius * draw_scale;
-        type = food.type - Food::grass;
+        type = food_type - Food::grass;
     }
 };
 
@@ -166,13 +166,37 @@ struct CreatureData
     }
 };
 
+struct CreatureState  // copy of the selected creature, stays valid while the world steps
+{
+    uint64_t id;
+    Genome genome;
+    Position pos;
+    angle_t angle;
+    uint64_t energy;
+    uint32_t total_life;
+    std::vector<uint8_t> input;
+
+    CreatureState() : id(-1)
+    {
+    }
+
+    void set(const Creature &cr)
+    {
+        id = cr.id;  genome = *cr.genome;
+        pos = cr.pos;  angle = cr.angle;
+        energy = cr.energy;  total_life = cr.total_life;
+        input.assign(cr.input.begin(), cr.input.end());
+    }
+};
+
 struct SectorData
 {
     GLfloat x, y, rad;
     GLubyte angle, delta;
     uint32_t color1, color2;
 
-    SectorData(const Creature &cr, angle_t angle1, angle_t angle2, GLfloat radius, uint32_t color, bool fade) :
+    SectorData() = default;
+    SectorData(const CreatureState &cr, angle_t angle1, angle_t angle2, GLfloat radius, uint32_t color, bool fade) :
         x(cr.pos.x * draw_scale), y(cr.pos.y * draw_scale), rad(radius),
         angle(angle_t(cr.angle + angle1)), delta(angle_t(angle2 - angle1 - 1)),
         color1(color), color2(fade ? color & 0xFFFFFF : color)
@@ -195,7 +219,7 @@ struct LegData
     GLubyte angle;
     uint32_t color;
 
-    LegData(const Creature &cr, angle_t angle, uint32_t speed, uint32_t color) :
+    LegData(const CreatureState &cr, angle_t angle, uint32_t speed, uint32_t color) :
         x(cr.pos.x * draw_scale), y(cr.pos.y * draw_scale), speed(speed * speed_scale),
         angle(angle_t(cr.angle + angle)), color(color)
     {
@@ -1,12 +1,20 @@
 // world.cpp : world mechanics implementation
 //
 
+#ifdef HEADLESS
+#include "world.h"
+#else
 #include "video.h"
+#endif
 #include "stream.h"
 #include <algorithm>
 #include <cassert>
 #include <memory>
 #include <cmath>
+#ifdef __linux__
+#include <pthread.h>
+#include <dirent.h>
+#endif
 
 
 
@@ -119,38 +127,55 @@ void Detector::reset(uint64_t r2)
 }
 
 void Detector::update(uint64_t r2, const Creature *cr)
+{
+    update(r2, cr->id, cr);
+}
+
+void Detector::update(uint64_t r2, uint64_t tg_id, const Creature *cr)
 {
     if(r2 > min_r2)return;
-    if(r2 == min_r2 && cr->id > id)return;
-    min_r2 = r2;  id = cr->id;  target = cr;
+    if(r2 == min_r2 && tg_id > id)return;
+    min_r2 = r2;  id = tg_id;  target = cr;
 }
 
 
 
-// Food struct
+// Targets struct
 
-Food::Food(const Config &config, Type type, const Position &pos) : type(type), pos(pos), eater(config.base_r2)
+void Targets::assign(const std::vector<Creature *> &creatures)
 {
+    size_t n = creatures.size();
+    x.resize(n);  y.resize(n);  id.resize(n);  claw_r2.resize(n);  angle.resize(n);  flags.resize(n);
+    for(size_t i = 0; i < n; i++)
+    {
+        const Creature *cr = creatures[i];
+        x[i] = cr->pos.x;  y[i] = cr->pos.y;  id[i] = cr->id;  claw_r2[i] = cr->claw_r2;
+        angle[i] = cr->angle;  flags[i] = cr->flags;
+    }
 }
 
-Food::Food(const Config &config, const Food &food) : Food(config, food.type > sprout ? food.type : grass, food.pos)
+void Targets::swap(Targets &targets)
 {
+    x.swap(targets.x);  y.swap(targets.y);  id.swap(targets.id);  claw_r2.swap(targets.claw_r2);
+    angle.swap(targets.angle);  flags.swap(targets.flags);
 }
 
-void Food::set(const Config &config, const Food &food)
+void Targets::clear()
 {
-    type = food.type > sprout ? food.type : grass;
-    pos = food.pos;  eater.reset(config.base_r2);
+    x.clear();  y.clear();  id.clear();  claw_r2.clear();  angle.clear();  flags.clear();
 }
 
 
+
+// Food struct
+
 void Food::check_grass(const Config &config, const Food *food, size_t n)
 {
     assert(type == sprout);
     for(size_t i = 0; i < n; i++)if(food[i].type == grass)
     {
-        int32_t dx = pos.x - food[i].pos.x;
-        int32_t dy = pos.y - food[i].pos.y;
+        int32_t dx = x - food[i].x;
+        int32_t dy = y - food[i].y;
         uint64_t r2 = int64_t(dx) * dx + int64_t(dy) * dy;
         if(r2 >= config.repression_r2)continue;
         type = dead;  return;
@@ -160,21 +185,16 @@ void Food::check_grass(const Config &config, const Food *food, size_t n)
 
 bool Food::load(const Config &config, InStream &stream, uint64_t offs_x, uint64_t offs_y)
 {
-    eater.reset(config.base_r2);
-
-    uint32_t x, y;  stream >> x >> y;  if(!stream)return false;
+    uint32_t xx, yy;  stream >> xx >> yy;  if(!stream)return false;
 
-    type = Type(x >> tile_order);
-    pos.x = x & tile_mask | offs_x;  pos.y = y | offs_y;
-    return type > dead && type <= meat && !(y >> tile_order);
+    type = Type(xx >> tile_order);
+    x = xx & tile_mask | uint32_t(offs_x);  y = yy | uint32_t(offs_y);
+    return type > dead && type <= meat && !(yy >> tile_order);
 }
 
 void Food::save(OutStream &stream) const
 {
-    uint32_t x = pos.x & tile_mask;
-    uint32_t y = pos.y & tile_mask;
-    x |= uint32_t(type) << tile_order;
-    stream << x << y;
+    stream << (x & tile_mask | uint32_t(type) << tile_order) << (y & tile_mask);
 }
 
 
@@ -225,30 +245,26 @@ Genome::Genome(const Config &config)
 }
 
 
-struct GeneSequence
+Genome::Genome(const Config &config, Random &rand, const Genome &parent, const Genome *father)
 {
-    const Genome::Gene *start;
-    size_t count;  uint32_t next;
-
-    GeneSequence(const Genome::Gene *start, size_t count) : start(start), count(count), next(-1)
-    {
-    }
-};
+    if(!init(config, rand, parent, father))*this = parent;
+}
 
-Genome::Genome(const Config &config, Random &rand, const Genome &parent, const Genome *father)
+bool Genome::init(const Config &config, Random &rand, const Genome &parent, const Genome *father)  // false for exact copy of parent, left empty
 {
     uint32_t chromosome_count = uint32_t(1) << config.chromosome_bits;
     assert(parent.chromosomes.size() == chromosome_count);
 
     // stage 1: clone or take one of every pair from parents
 
+    Scratch::Lease lease;  auto &seqs = lease.scratch.seqs;
     uint32_t n = 10;  // TODO: config?
-    std::vector<GeneSequence> seqs;
-    seqs.reserve(chromosome_count + n);
+    seqs.clear();  seqs.reserve(chromosome_count + n);
     if(father)
     {
         assert(father->chromosomes.size() == chromosome_count);
-        std::vector<uint8_t> pairs(std::max<uint32_t>(1, chromosome_count >> 5));
+        auto &pairs = lease.scratch.pairs;
+        pairs.resize(std::max<uint32_t>(1, chromosome_count >> 5));
         for(auto &pair : pairs)pair = rand.uint32();
 
         const Gene *pos_m = parent.genes.data();
@@ -297,7 +313,7 @@ Genome::Genome(const Config &config, Random &rand, const Genome &parent, const G
         len -= seqs[pos].count;
     }
 
-    std::vector<uint32_t> last(chromosome_count);
+    auto &last = lease.scratch.last;  last.resize(chromosome_count);
     for(uint32_t i = 0; i < chromosome_count; i++)last[i] = i;
     for(uint32_t i = chromosome_count; i < seqs.size(); i++)
     {
@@ -308,6 +324,7 @@ Genome::Genome(const Config &config, Random &rand, const Genome &parent, const G
     // stage 3: delete or duplicate whole chromosomes
 
     uint32_t pos = rand.geometric(config.chromosome_replace_factor);
+    bool changed = father || seqs.size() > chromosome_count || pos < chromosome_count;
     while(pos < chromosome_count)
     {
         uint32_t index = rand.uint32();
@@ -335,6 +352,21 @@ Genome::Genome(const Config &config, Random &rand, const Genome &parent, const G
 
         total_size += chromosomes[i] = size;
     }
+
+    // stage 4: mutate individual bits, positions are drawn first
+
+    auto &flips = lease.scratch.flips;  flips.clear();
+    pos = rand.geometric(config.bit_mutate_factor);
+    while(pos < 64 * total_size)
+    {
+        flips.push_back(pos);
+        pos += rand.geometric(config.bit_mutate_factor) + 1;
+    }
+    if(!changed && flips.empty())
+    {
+        chromosomes.clear();  return false;
+    }
+
     genes.reserve(total_size);
     for(uint32_t i = 0; i < chromosome_count; i++)
     {
@@ -350,14 +382,23 @@ Genome::Genome(const Config &config, Random &rand, const Genome &parent, const G
     }
     assert(genes.size() == total_size);
 
-    // stage 4: mutate individual bits
+    for(uint32_t pos : flips)genes[pos >> 6].data ^= uint64_t(1) << (pos & 63);
+    return true;
+}
 
-    pos = rand.geometric(config.bit_mutate_factor);
-    while(pos < 64 * total_size)
-    {
-        genes[pos >> 6].data ^= uint64_t(1) << (pos & 63);
-        pos += rand.geometric(config.bit_mutate_factor) + 1;
-    }
+
+uint64_t Genome::digest() const
+{
+    const uint64_t mul = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = genes.size();
+    for(uint32_t chromosome : chromosomes)hash = (hash ^ chromosome) * mul;
+    for(const auto &gene : genes)hash = (hash ^ gene.data) * mul;
+    return hash ^ hash >> 32;
+}
+
+bool Genome::operator == (const Genome &cmp) const
+{
+    return chromosomes == cmp.chromosomes && genes == cmp.genes;
 }
 
 
@@ -387,6 +428,65 @@ void Genome::save(OutStream &stream) const
 
 
 
+// GenomePool class
+
+GenomePool::GenomePool() : unique_count(0), gene_count(0)
+{
+}
+
+GenomePool &GenomePool::instance()
+{
+    static GenomePool pool;
+    return pool;
+}
+
+GenomeRef GenomePool::intern(Genome &&genome)
+{
+    uint64_t digest = genome.digest();
+    Shard &shard = shards[digest >> (64 - shard_bits)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto range = shard.genomes.equal_range(digest);
+    for(auto it = range.first; it != range.second; ++it)
+    {
+        // release() erases under the lock before deleting, so the genome is alive
+        if(!(*it->second.genome == genome))continue;
+        GenomeRef ref = it->second.ref.lock();
+        if(ref)return ref;
+    }
+
+    const Genome *ptr = new Genome(std::move(genome));
+    GenomeRef ref(ptr, [this, digest](const Genome *ptr){ release(ptr, digest); });
+    shard.genomes.emplace(digest, Entry{ptr, ref});
+    unique_count.fetch_add(1, std::memory_order_relaxed);
+    gene_count.fetch_add(ptr->genes.size(), std::memory_order_relaxed);
+    return ref;
+}
+
+void GenomePool::release(const Genome *genome, uint64_t digest)
+{
+    Shard &shard = shards[digest >> (64 - shard_bits)];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto range = shard.genomes.equal_range(digest);
+        for(auto it = range.first; it != range.second; ++it)if(it->second.genome == genome)
+        {
+            shard.genomes.erase(it);  break;
+        }
+    }
+    unique_count.fetch_sub(1, std::memory_order_relaxed);
+    gene_count.fetch_sub(genome->genes.size(), std::memory_order_relaxed);
+    delete genome;
+}
+
+void GenomePool::counts(uint64_t &unique, uint64_t &genes) const
+{
+    unique = unique_count.load(std::memory_order_relaxed);
+    genes = gene_count.load(std::memory_order_relaxed);
+}
+
+
+
 // GenomeProcessor class
 
 void GenomeProcessor::State::reset(size_t link_pos)
@@ -509,7 +609,8 @@ void GenomeProcessor::update(const Config &config, const Genome &genome)
     uint32_t slot_count = uint32_t(1) << config.slot_bits;
     slots.resize(slot_count);  links.clear();
 
-    std::vector<Genome::Gene> genes = genome.genes;
+    Scratch::Lease lease;  auto &genes = lease.scratch.genes;
+    genes.assign(genome.genes.begin(), genome.genes.end());
     std::sort(genes.begin(), genes.end());
     links.reserve(genes.size());
 
@@ -523,30 +624,11 @@ void GenomeProcessor::update(const Config &config, const Genome &genome)
     while(index < slot_count)state.create_slot(slots[index++], links.size());
 }
 
-struct Reference
-{
-    uint32_t source, target;
-    int32_t weight;
-
-    explicit Reference(uint32_t source) : source(source)
-    {
-    }
-
-    Reference(uint32_t target, const GenomeProcessor::LinkData &link) :
-        source(link.source), target(target), weight(link.weight)
-    {
-    }
-
-    bool operator < (const Reference &cmp) const
-    {
-        return source < cmp.source;
-    }
-};
-
 void GenomeProcessor::finalize()
 {
-    std::vector<uint32_t> queue;  queue.reserve(slots.size());
-    std::vector<Reference> refs;  refs.reserve(links.size() + 1);
+    Scratch::Lease lease;
+    auto &queue = lease.scratch.queue;  queue.clear();  queue.reserve(slots.size());
+    auto &refs = lease.scratch.refs;  refs.clear();  refs.reserve(links.size() + 1);
     for(size_t i = 0; i < slots.size(); i++)
     {
         if(slots[i].neiro_state)
@@ -568,8 +650,8 @@ void GenomeProcessor::finalize()
     std::sort(refs.begin(), refs.end());
     refs.emplace_back(slots.size());
 
-    std::vector<uint32_t> ref_pos;
-    ref_pos.reserve(slots.size() + 1);
+    auto &ref_pos = lease.scratch.ref_pos;
+    ref_pos.clear();  ref_pos.reserve(slots.size() + 1);
     ref_pos.push_back(0);  uint32_t pos = 0;
     for(size_t i = 0; i < slots.size(); i++)
     {
@@ -651,6 +733,81 @@ void GenomeProcessor::process(const Config &config, const Genome &genome)
 
 
 
+// Scratch class
+
+std::atomic<uint64_t> Scratch::allocs(0);
+
+size_t Scratch::capacity() const  // buffers never shrink, so any growth changes the sum
+{
+    return seqs.capacity() + pairs.capacity() + last.capacity() + flips.capacity() +
+        genes.capacity() + queue.capacity() + ref_pos.capacity() + refs.capacity() +
+        slots.capacity() + mapping.capacity();
+}
+
+Scratch &Scratch::local()
+{
+    static thread_local Scratch scratch;
+    return scratch;
+}
+
+Scratch::Lease::Lease() : scratch(local())
+{
+    if(!scratch.depth++)capacity = scratch.capacity();
+}
+
+Scratch::Lease::~Lease()  // inner leases would count the same growth again
+{
+    if(!--scratch.depth && scratch.capacity() != capacity)allocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Scratch::alloc_count()
+{
+    return allocs.load(std::memory_order_relaxed);
+}
+
+
+
+// BrainCache class
+
+BrainCache::BrainCache() : entries(size_t(1) << brain_cache_bits), hits(0), misses(0)
+{
+}
+
+std::shared_ptr<const GenomeProcessor> BrainCache::get(const Config &config, const GenomeRef &genome)
+{
+    size_t index = genome->digest() & (entries.size() - 1);
+    std::mutex &mutex = locks[index & ((1u << lock_bits) - 1)];  Entry &entry = entries[index];
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(entry.genome == genome)  // genomes are interned
+        {
+            hits.fetch_add(1, std::memory_order_relaxed);  return entry.proc;
+        }
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+
+    auto proc = std::make_shared<const GenomeProcessor>(config, *genome);
+    Entry prev{genome, proc};  // old entry is freed outside of the lock
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(entry, prev);
+    }
+    return proc;
+}
+
+void BrainCache::counts(uint64_t &hit_count, uint64_t &miss_count) const
+{
+    hit_count = hits.load(std::memory_order_relaxed);
+    miss_count = misses.load(std::memory_order_relaxed);
+}
+
+void BrainCache::clear()
+{
+    for(auto &entry : entries)entry = Entry();
+}
+
+
+
 // Creature struct
 
 Creature::Womb::Womb(const Config &config, const GenomeProcessor::SlotData &slot) :
@@ -751,12 +908,12 @@ Slot::Type Creature::append_slot(const Config &config, const GenomeProcessor::Sl
 
     case Slot::eye:
         eyes.emplace_back(config, slot);
-        update_max_visibility(eyes.rbegin()->flags, eyes.rbegin()->rad_sqr);
+        update_max_visibility(eyes.back().flags, eyes.back().rad_sqr);
         break;
 
     case Slot::radar:
         radars.emplace_back(config, slot);
-        update_max_visibility(radars.rbegin()->flags, max_r2);
+        update_max_visibility(radars.back().flags, max_r2);
         break;
 
     default:
@@ -799,31 +956,71 @@ void Creature::calc_mapping(const GenomeProcessor &proc, std::vector<uint32_t> &
     }
 }
 
-Creature::Creature(const Config &config, Genome &genome, const GenomeProcessor &proc,
+template<typename T> static void place_array(Creature *cr, Creature::Array<T> Creature::*array, uintptr_t &pos, uint32_t capacity)
+{
+    if(cr)(cr->*array).place(pos, capacity);
+    else Creature::Array<T>::reserve(pos, capacity);
+}
+
+uintptr_t Creature::place_arrays(Creature *cr, uintptr_t pos, const GenomeProcessor &proc)  // returns end, only measures if cr is null
+{
+    const uint32_t *count = proc.count;
+    uint32_t neiron_count = count[Slot::womb] + count[Slot::claw] + count[Slot::leg] +
+        count[Slot::rotator] + count[Slot::mouth] + count[Slot::signal] + count[Slot::link];
+    uint32_t input_count = neiron_count +
+        count[Slot::stomach] + count[Slot::hide] + count[Slot::eye] + count[Slot::radar];
+
+    place_array(cr, &Creature::wombs, pos, count[Slot::womb]);
+    place_array(cr, &Creature::claws, pos, count[Slot::claw]);
+    place_array(cr, &Creature::legs, pos, count[Slot::leg]);
+    place_array(cr, &Creature::rotators, pos, count[Slot::rotator]);
+    place_array(cr, &Creature::signals, pos, count[Slot::mouth] + count[Slot::signal]);
+
+    place_array(cr, &Creature::stomachs, pos, count[Slot::stomach]);
+    place_array(cr, &Creature::hides, pos, count[Slot::hide]);
+    place_array(cr, &Creature::eyes, pos, count[Slot::eye]);
+    place_array(cr, &Creature::radars, pos, count[Slot::radar]);
+
+    place_array(cr, &Creature::input, pos, input_count);  // brain data in order of execute_step()
+    place_array(cr, &Creature::neirons, pos, neiron_count);
+    place_array(cr, &Creature::links, pos, proc.working_links);
+    place_array(cr, &Creature::order, pos, neiron_count);
+    return pos;
+}
+
+size_t Creature::alloc_size(const GenomeProcessor &proc)  // arrays have the same layout at any word-aligned start
+{
+    return (sizeof(Creature) + place_arrays(nullptr, 0, proc) + pool_granule - 1) & ~size_t(pool_granule - 1);
+}
+
+Creature::Creature(const Config &config, const GenomeRef &genome, const GenomeProcessor &proc,
     uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy) :
-    id(id), genome(std::move(genome)), pos(pos), angle(angle),
+    id(id), genome(genome), pos(pos), angle(angle), flags(f_creature), size(alloc_size(proc)),
     energy(std::min(spawn_energy - proc.passive_cost.initial, proc.max_energy)),
     max_energy(proc.max_energy), passive_cost(proc.passive_cost), food_energy(0),
     total_life(proc.max_life), max_life(proc.max_life), damage(0),
     attack_count(0), creature_vis_r2{}, food_vis_r2{}, claw_r2(0),
-    father(config.base_r2), flags(f_creature)
+    father(config.base_r2)
 {
+    uintptr_t end = place_arrays(this, reinterpret_cast<uintptr_t>(this + 1), proc);
+    assert(end <= reinterpret_cast<uintptr_t>(this) + size);  (void)end;
+
     uint32_t offset[Slot::invalid], n = 0;
-    wombs.reserve(update_counters(proc.count, offset, n, Slot::womb));
-    claws.reserve(update_counters(proc.count, offset, n, Slot::claw));
-    legs.reserve(update_counters(proc.count, offset, n, Slot::leg));
-    rotators.reserve(update_counters(proc.count, offset, n, Slot::rotator));
-    signals.reserve(update_counters(proc.count, offset, n, Slot::signal));
+    update_counters(proc.count, offset, n, Slot::womb);
+    update_counters(proc.count, offset, n, Slot::claw);
+    update_counters(proc.count, offset, n, Slot::leg);
+    update_counters(proc.count, offset, n, Slot::rotator);
+    update_counters(proc.count, offset, n, Slot::signal);
     update_counters(proc.count, offset, n, Slot::link);
-    order.reserve(n);  neirons.resize(n);
+    neirons.resize(n);
 
-    stomachs.reserve(update_counters(proc.count, offset, n, Slot::stomach));
-    hides.reserve(update_counters(proc.count, offset, n, Slot::hide));
-    eyes.reserve(update_counters(proc.count, offset, n, Slot::eye));
-    radars.reserve(update_counters(proc.count, offset, n, Slot::radar));
-    std::vector<slot_t> slots(n);  input.resize(n, 0);
-
-    std::vector<uint32_t> mapping(proc.slots.size(), -1);
+    update_counters(proc.count, offset, n, Slot::stomach);
+    update_counters(proc.count, offset, n, Slot::hide);
+    update_counters(proc.count, offset, n, Slot::eye);
+    update_counters(proc.count, offset, n, Slot::radar);
+    Scratch::Lease lease;  input.resize(n, 0);
+    auto &slots = lease.scratch.slots;  slots.resize(n);
+    auto &mapping = lease.scratch.mapping;  mapping.assign(proc.slots.size(), -1);
     for(size_t i = 0; i < proc.slots.size(); i++)
     {
         if(!proc.slots[i].used)continue;
@@ -846,7 +1043,6 @@ Creature::Creature(const Config &config, Genome &genome, const GenomeProcessor &
     assert(eyes.size()     == proc.count[Slot::eye]);
     assert(radars.size()   == proc.count[Slot::radar]);
 
-    links.reserve(proc.working_links);
     for(size_t i = 0; i < neirons.size(); i++)
     {
         const auto &slot = proc.slots[slots[i]];
@@ -872,20 +1068,28 @@ Creature::Creature(const Config &config, Genome &genome, const GenomeProcessor &
     assert(links.size() == proc.working_links);
 }
 
-Creature *Creature::spawn(const Config &config, Genome &genome,
-    uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy)
+Creature *Creature::spawn(const Config &config, const GenomeRef &genome,
+    uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy,
+    CreaturePool *pool, BrainCache *brains)
 {
-    GenomeProcessor proc(config, genome);
-    if(spawn_energy < proc.passive_cost.initial)return nullptr;
-    return new Creature(config, genome, proc, id, pos, angle, spawn_energy);
+    std::shared_ptr<const GenomeProcessor> proc = brains ? brains->get(config, genome) :
+        std::make_shared<const GenomeProcessor>(config, *genome);
+    if(spawn_energy < proc->passive_cost.initial)return nullptr;
+    size_t size = alloc_size(*proc);
+    void *ptr = pool ? pool->alloc(size) : ::operator new(size);
+    Creature *cr = new(ptr) Creature(config, genome, *proc, id, pos, angle, spawn_energy);
+    cr->size = size;  return cr;
 }
 
 Creature *Creature::spawn(const Config &config, Random &rand, const Creature &parent,
-    uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy)
+    uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy,
+    CreaturePool *pool, BrainCache *brains)
 {
     const Creature *father = parent.father.target;
-    Genome genome(config, rand, parent.genome, father ? &father->genome : nullptr);
-    return spawn(config, genome, id, pos, angle, spawn_energy);
+    Genome genome;  // shares parent genome if not changed
+    if(!genome.init(config, rand, *parent.genome, father ? father->genome.get() : nullptr))
+        return spawn(config, parent.genome, id, pos, angle, spawn_energy, pool, brains);
+    return spawn(config, GenomePool::instance().intern(std::move(genome)), id, pos, angle, spawn_energy, pool, brains);
 }
 
 
@@ -926,8 +1130,8 @@ void Creature::process_food(const std::vector<Food> &foods)
 {
     for(auto &food : foods)if(food.type > Food::sprout)
     {
-        int32_t dx = food.pos.x - pos.x;
-        int32_t dy = food.pos.y - pos.y;
+        int32_t dx = food.x - uint32_t(pos.x);
+        int32_t dy = food.y - uint32_t(pos.y);
         uint64_t r2 = int64_t(dx) * dx + int64_t(dy) * dy;
         if(!r2)continue;  // invalid angle
 
@@ -936,31 +1140,31 @@ void Creature::process_food(const std::vector<Food> &foods)
     }
 }
 
-void Creature::eat_food(std::vector<Food> &foods) const
+void Creature::eat_food(const Food *food, Detector *eater, size_t n) const
 {
     assert(flags & f_eating);
-    for(auto &food : foods)if(food.type > Food::sprout)
+    for(size_t i = 0; i < n; i++)if(food[i].type > Food::sprout)
     {
-        int32_t dx = food.pos.x - pos.x;
-        int32_t dy = food.pos.y - pos.y;
+        int32_t dx = food[i].x - uint32_t(pos.x);
+        int32_t dy = food[i].y - uint32_t(pos.y);
         uint64_t r2 = int64_t(dx) * dx + int64_t(dy) * dy;
-        food.eater.update(r2, this);
+        eater[i].update(r2, this);
     }
 }
 
-void Creature::process_detectors(const Creature *cr)
+void Creature::process_detectors(const Creature *cr, const Targets &tg, size_t index)
 {
-    int32_t dx = cr->pos.x - pos.x;
-    int32_t dy = cr->pos.y - pos.y;
+    int32_t dx = tg.x[index] - pos.x;
+    int32_t dy = tg.y[index] - pos.y;
     uint64_t r2 = int64_t(dx) * dx + int64_t(dy) * dy;
-    father.update(r2, cr);  if(!r2)return;  // invalid angle
+    father.update(r2, tg.id[index], cr);  if(!r2)return;  // invalid angle
 
-    uint64_t view = creature_vis_r2[cr->flags & f_signals];
-    if(r2 >= std::max(view, cr->claw_r2))return;
+    uint64_t view = creature_vis_r2[tg.flags[index] & f_signals], claw_r2 = tg.claw_r2[index];
+    if(r2 >= std::max(view, claw_r2))return;
 
     angle_t angle = calc_angle(dx, dy);
-    if(r2 < view)update_view(cr->flags, r2, angle);
-    if(r2 < cr->claw_r2)update_damage(cr, r2, angle);
+    if(r2 < view)update_view(tg.flags[index], r2, angle);
+    if(r2 < claw_r2)update_damage(cr, r2, angle);
 }
 
 void Creature::post_process(const Config &config)
@@ -989,12 +1193,13 @@ uint64_t Creature::execute_step(const Config &config)
     uint64_t total_energy = passive_cost.initial + energy;
     food_energy = 0;
 
-    for(auto &neiron : neirons)neiron.level = 0;
+    int32_t level[size_t(1) << 8 * sizeof(slot_t)];  // neirons are indexed by slot_t
+    std::memset(level, 0, neirons.size() * sizeof(int32_t));
     for(const auto &link : links)
-        neirons[link.output].level += link.weight * int16_t(input[link.input]);
+        level[link.output] += link.weight * int16_t(input[link.input]);
 
     for(size_t i = 0; i < neirons.size(); i++)
-        input[i] = neirons[i].level > neirons[i].act_level ? 255 : 0;
+        input[i] = level[i] > neirons[i].act_level ? 255 : 0;
 
     total_life = 0;
     for(size_t i = hides.size() - 1; i != size_t(-1); i--)
@@ -1047,7 +1252,8 @@ Creature *Creature::load(const Config &config, InStream &stream, uint64_t next_i
     uint32_t x, y;  angle_t angle;  uint64_t energy;
     stream >> x >> y >> angle >> align(8) >> energy;
     if(!stream || id >= next_id || (x >> tile_order) || (y >> tile_order))return nullptr;
-    std::unique_ptr<Creature> cr(spawn(config, genome, id, Position{x, y}, angle, uint64_t(-1)));
+    std::unique_ptr<Creature> cr(spawn(config,
+        GenomePool::instance().intern(std::move(genome)), id, Position{x, y}, angle, uint64_t(-1)));
     return cr && cr->load(stream, energy, buf) ? cr.release() : nullptr;
 }
 
@@ -1087,7 +1293,7 @@ bool Creature::load(InStream &stream, uint64_t load_energy, uint64_t *buf)
 
 void Creature::save(OutStream &stream, uint64_t *buf) const
 {
-    stream << id << genome;
+    stream << id << *genome;
     stream << uint32_t(pos.x & tile_mask) << uint32_t(pos.y & tile_mask);
     stream << angle << align(8) << energy;
 
@@ -1106,33 +1312,127 @@ void Creature::save(OutStream &stream, uint64_t *buf) const
 
 
 
+// CreaturePool struct
+
+void *CreaturePool::alloc(size_t &bytes)  // can return a bit larger block
+{
+    size_t index = bytes / pool_granule - 1;
+    size_t end = std::min<size_t>(index + pool_class_slack, pool_class_count);
+    for(; index < end; index++)if(first[index])
+    {
+        Block *block = first[index];  first[index] = block->next;
+        bytes = (index + 1) * pool_granule;  size--;  memory -= bytes;
+        reused++;  return block;
+    }
+    fresh++;  return ::operator new(bytes);
+}
+
+void CreaturePool::free(Creature *cr)
+{
+    size_t bytes = cr->size, index = bytes / pool_granule - 1;
+    cr->~Creature();
+    if(size >= max_pool_size || index >= pool_class_count)
+    {
+        ::operator delete(cr);  return;
+    }
+    Block *block = new(cr) Block;
+    block->next = first[index];  first[index] = block;  size++;  memory += bytes;
+}
+
+void CreaturePool::swap(CreaturePool &pool)
+{
+    std::swap(first, pool.first);  std::swap(size, pool.size);  std::swap(memory, pool.memory);
+    std::swap(fresh, pool.fresh);  std::swap(reused, pool.reused);
+}
+
+void CreaturePool::clear()
+{
+    for(auto &list : first)
+    {
+        for(Block *ptr = list; ptr;)
+        {
+            Block *block = ptr;  ptr = ptr->next;  ::operator delete(block);
+        }
+        list = nullptr;
+    }
+    size = 0;  memory = 0;
+}
+
+
+
 // TileLayout struct
 
-TileLayout::TileLayout(uint32_t size_x, uint32_t size_y, uint32_t group_count) :
-    size_x(size_x), size_y(size_y), tiles(size_x * size_y), groups(group_count)
+TileLayout::TileLayout(uint32_t size_x, uint32_t size_y, uint32_t group_count, const uint64_t *cost, bool hilbert) :
+    size_x(size_x), size_y(size_y), tiles(size_x * size_y), groups(group_count), order(tiles.size())
 {
+    if(hilbert)hilbert_order();
+    else for(size_t i = 0; i < order.size(); i++)order[i] = i;
+
+    uint64_t total = tiles.size(), sum = 0;  // groups cover consecutive tiles of equal total cost
+    if(cost)for(size_t i = total = 0; i < tiles.size(); i++)total += cost[i];
     for(size_t i = 0; i < tiles.size(); i++)
     {
-        uint32_t group = uint64_t(i) * group_count / tiles.size();
+        uint32_t k = order[i];
+        uint64_t pos = cost ? 2 * sum + cost[k] : 2 * i;  sum += cost ? cost[k] : 1;
+        uint32_t group = pos * group_count / (2 * total);
 
-        tiles[i].group = group;
-        tiles[i].index = groups[group].tile_count++;
-        tiles[i].ref_count = 0;
+        tiles[k].group = group;
+        tiles[k].index = groups[group].tile_count++;
+        tiles[k].ref_count = 0;
     }
+    for(uint32_t i = 1; i < group_count; i++)
+        groups[i].first_tile = groups[i - 1].first_tile + groups[i - 1].tile_count;
 }
 
-void TileLayout::process_tile(TileDesc &cur, const Offsets &offs_x, const Offsets &offs_y)
+void TileLayout::hilbert_order()  // square blocks along the longer side, curve from corner to corner in each
 {
-    uint32_t prev = -1, ref;
-    for(int i = 0; i < 3; i++)for(int j = 0; j < 3; j++)
+    uint32_t side = std::min(size_x, size_y);
+    for(uint32_t i = 0; i < order.size(); i++)
     {
-        TileDesc &tile = tiles[offs_y.pos[i] + offs_x.pos[j]];
-        if(prev != tile.group)
+        uint32_t x = 0, y = 0;
+        for(uint32_t s = 1, t = i % (side * side); s < side; s *= 2, t /= 4)
         {
-            ref = groups[prev = tile.group].ref_count++;
-            cur.refs[cur.ref_count++] = {prev, ref};
+            uint32_t rx = 1 & (t / 2), ry = 1 & (t ^ rx);
+            if(!ry)
+            {
+                if(rx)
+                {
+                    x = s - 1 - x;  y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+            x += s * rx;  y += s * ry;
         }
-        tile.neighbors[4 + offs_y.offs[i] + offs_x.offs[j]] = ref;
+        uint32_t block = i / (side * side) * side;
+        order[i] = size_x >= size_y ? (block + x) + y * size_x : y + (block + x) * size_x;
+    }
+}
+
+uint32_t TileLayout::ref_total() const  // cross-tile buffers, including own group ones
+{
+    uint32_t total = 0;
+    for(auto &group : groups)total += group.ref_count;
+    return total;
+}
+
+void TileLayout::process_tile(TileDesc &cur, const Offsets &offs_x, const Offsets &offs_y)  // refs in group order
+{
+    uint32_t group[9];  int n = 0;
+    for(int i = 0; i < 9; i++)
+    {
+        int k = 0;  uint32_t cur_group = tiles[offs_y.pos[i / 3] + offs_x.pos[i % 3]].group;
+        while(k < n && group[k] < cur_group)k++;
+        if(k < n && group[k] == cur_group)continue;
+        for(int j = n++; j > k; j--)group[j] = group[j - 1];
+        group[k] = cur_group;
+    }
+    for(int k = 0; k < n; k++)cur.refs[cur.ref_count++] = {group[k], groups[group[k]].ref_count++};
+
+    for(int i = 0; i < 3; i++)for(int j = 0; j < 3; j++)
+    {
+        TileDesc &tile = tiles[offs_y.pos[i] + offs_x.pos[j]];
+        int k = 0;  while(cur.refs[k].group != tile.group)k++;
+        tile.neighbors[4 + offs_y.offs[i] + offs_x.offs[j]] = cur.refs[k].index;
     }
 }
 
@@ -1158,22 +1458,61 @@ void TileLayout::build_layout()
 
 // TileGroup struct
 
+void TileGroup::TileBuffer::mark(uint32_t tile)  // after execute_step() of the tile, if anything was added
+{
+    uint32_t food_beg = sources.empty() ? 0 : sources.back().food_end;
+    uint32_t creature_beg = sources.empty() ? 0 : sources.back().creature_end;
+    if(foods.size() == food_beg && creatures.size() == creature_beg)return;
+    sources.push_back(Source{tile, uint32_t(foods.size()), uint32_t(creatures.size())});
+}
+
+void TileGroup::TileBuffer::clear()
+{
+    foods.clear();  creatures.clear();  sources.clear();
+    food_count = creature_count = attack_count = 0;
+}
+
+TileGroup::~TileGroup()
+{
+    free_deleted();
+}
+
 void TileGroup::alloc(const TileLayout::GroupDesc &desc)
 {
-    tiles.resize(desc.tile_count);  buffers.resize(desc.ref_count);
+    first_tile = desc.first_tile;  tiles.resize(desc.tile_count);
+    buffers.resize(desc.ref_count);  targets.resize(desc.ref_count);
 }
 
-TileGroup::Tile::Tile()
+void TileGroup::free_deleted()
 {
-    first = nullptr;  last = &first;
+    for(Creature *cr : deleted)pool.free(cr);
+    deleted.clear();
 }
 
-TileGroup::Tile::~Tile()
+void TileGroup::relocate()  // reallocates from the calling thread to get memory on its node
 {
-    for(Creature *ptr = first; ptr;)
+    std::vector<Tile> prev(tiles.size());  prev.swap(tiles);
+    for(size_t i = 0; i < tiles.size(); i++)
     {
-        Creature *cr = ptr;  ptr = ptr->next;  delete cr;
+        Tile &tile = tiles[i];
+        tile.x = prev[i].x;  tile.y = prev[i].y;
+        std::memcpy(tile.neighbors, prev[i].neighbors, sizeof(tile.neighbors));
+        std::memcpy(tile.refs, prev[i].refs, sizeof(tile.refs));
+        tile.ref_count = prev[i].ref_count;
+
+        tile.move(prev[i]);
+        std::vector<Food>(tile.foods).swap(tile.foods);
+        std::vector<Detector>(tile.eaters).swap(tile.eaters);
+        std::vector<Creature *>(tile.creatures).swap(tile.creatures);
     }
+    std::vector<TileBuffer>(buffers.size()).swap(buffers);
+    std::vector<uint32_t>(targets).swap(targets);
+    pool.clear();  // cached memory is on the previous node
+}
+
+TileGroup::Tile::~Tile()
+{
+    clear();
 }
 
 void TileGroup::Tile::init(const TileLayout::TileDesc &desc)
@@ -1183,6 +1522,25 @@ void TileGroup::Tile::init(const TileLayout::TileDesc &desc)
     ref_count = desc.ref_count;
 }
 
+void TileGroup::Tile::move(Tile &tile)  // takes contents, keeps own layout
+{
+    assert(foods.empty() && creatures.empty());
+    foods.swap(tile.foods);  eaters.swap(tile.eaters);  creatures.swap(tile.creatures);
+    credits.swap(tile.credits);  targets.swap(tile.targets);
+    food_count = tile.food_count;
+    creature_count = tile.creature_count;
+    attack_count = tile.attack_count;
+    rand = tile.rand;  spawn_start = tile.spawn_start;
+}
+
+void TileGroup::Tile::clear()  // frees contents
+{
+    for(Creature *cr : creatures)delete cr;
+    for(Creature *cr : children)delete cr;
+    creatures.clear();  children.clear();  foods.clear();  eaters.clear();  credits.clear();  targets.clear();
+    food_count = creature_count = attack_count = 0;
+}
+
 
 uint32_t TileGroup::neighbor_index(const Config &config, const Tile &tile, Position &pos)
 {
@@ -1204,7 +1562,7 @@ void TileGroup::spawn_grass(const Config &config, Tile &tile)  // TODO: tile rel
     {
         uint64_t xx = (tile.rand.uint32() & tile_mask) | offs_x;
         uint64_t yy = (tile.rand.uint32() & tile_mask) | offs_y;
-        buffers[tile.neighbors[4]].foods.emplace_back(config, Food::sprout, Position{xx, yy});
+        buffers[tile.neighbors[4]].foods.emplace_back(Food::sprout, Position{xx, yy});
     }
     for(size_t i = 0; i < tile.foods.size(); i++)
     {
@@ -1212,13 +1570,13 @@ void TileGroup::spawn_grass(const Config &config, Tile &tile)  // TODO: tile rel
         uint32_t n = tile.rand.poisson(config.exp_sprout_per_grass);
         for(uint32_t k = 0; k < n; k++)
         {
-            Position pos = tile.foods[i].pos;
+            Position pos = tile.foods[i].pos(offs_x, offs_y);
             angle_t angle = tile.rand.uint32();
             pos.x += r_sin(config.sprout_dist_x4, angle + angle_90);
             pos.y += r_sin(config.sprout_dist_x4, angle);
 
             uint32_t index = neighbor_index(config, tile, pos);
-            buffers[index].foods.emplace_back(config, Food::sprout, pos);
+            buffers[index].foods.emplace_back(Food::sprout, pos);
         }
     }
 }
@@ -1229,7 +1587,7 @@ void TileGroup::spawn_meat(const Config &config, Tile &tile, Position pos, uint6
     for(energy -= config.food_energy;;)
     {
         auto &buf = buffers[neighbor_index(config, tile, pos)];
-        buf.foods.emplace_back(config, Food::meat, pos);  buf.food_count++;
+        buf.foods.emplace_back(Food::meat, pos);  buf.food_count++;
         if(energy < config.food_energy)return;  energy -= config.food_energy;
 
         angle_t angle = tile.rand.uint32();
@@ -1238,36 +1596,77 @@ void TileGroup::spawn_meat(const Config &config, Tile &tile, Position pos, uint6
     }
 }
 
-void TileGroup::execute_step(const Config &config)
+void TileGroup::collect_credits(const Config &config,
+    const std::vector<Reference> &layout, const std::vector<TileGroup> &groups)  // before execute_step()
+{
+    for(auto &tile : tiles)for(uint32_t k = 0; k < 9; k++)
+    {
+        uint32_t x = (tile.x + k % 3 - 1) & config.mask_x, y = (tile.y + k / 3 - 1) & config.mask_y;
+        uint32_t dir = ((2 - k % 3) & config.mask_x) + 3 * ((2 - k / 3) & config.mask_y);  // of this tile from neighbor
+        const Reference &ref = layout[x | (y << config.order_x)];
+        const auto &credits = groups[ref.group].tiles[ref.index].credits;
+        for(size_t i = dir; i < credits.size(); i += 9)
+            for(auto &credit : credits[i])credit.target->food_energy += config.food_energy;
+    }
+}
+
+uint32_t TileGroup::add_parts(Tile &tile, uint32_t count)  // splits hot tile for parallel execute_part()
+{
+    tile.result_offset = uint32_t(-1);  if(count < 2)return 0;
+
+    uint32_t offset = results.size();
+    for(uint32_t i = 0, k = 0; i < count; i++)
+    {
+        uint32_t end = uint64_t(tile.creature_count) * (i + 1) / count;
+        parts.push_back(Part{tile.creatures.data() + k, offset + k, end - k});  k = end;
+    }
+    tile.result_offset = offset;  results.resize(offset + tile.creature_count);
+    return count;
+}
+
+void TileGroup::execute_part(const Config &config, uint32_t index)  // brains only, the rest is order dependent
 {
-    for(auto &buf : buffers)
+    const Part &part = parts[index];
+    for(uint32_t i = 0; i < part.count; i++)
     {
-        buf.foods.clear();  buf.last = &buf.first;
-        buf.food_count = buf.creature_count = buf.attack_count = 0;
+        Creature *cr = part.first[i];  StepResult &res = results[part.offset + i];
+        res.pos = cr->pos;  res.angle = cr->angle;
+        res.dead_energy = cr->execute_step(config);
     }
+}
+
+uint64_t TileGroup::execute_step(const Config &config, BrainCache &brains)
+{
+    free_deleted();  // no longer referenced as fathers
+    for(auto &buf : buffers)buf.clear();
 
-    Creature **del_last = &del_queue;
+    uint64_t allocs = 0;
     for(auto &tile : tiles)
     {
         auto &foods = tile.foods;  size_t n = 0;
-        for(size_t i = 0; i < foods.size(); i++)
-            if(!foods[i].eater.target && foods[i].type)foods[n++].set(config, foods[i]);
+        for(size_t i = 0; i < foods.size(); i++)if(!tile.eaters[i].target && foods[i].type)
+        {
+            foods[n] = foods[i];  if(foods[n].type == Food::sprout)foods[n].type = Food::grass;  n++;
+        }
         foods.resize(tile.spawn_start = tile.food_count = n);
         spawn_grass(config, tile);
 
-        uint64_t id = next_id;
-        Creature *ptr = tile.first;  tile.last = &tile.first;
+        uint64_t id = 0;  // temporary, consolidate() adds offset
         tile.creature_count = tile.attack_count = 0;
-        while(ptr)
+        const StepResult *res = parts.empty() || tile.result_offset == uint32_t(-1) ? nullptr : &results[tile.result_offset];
+        for(Creature *cr : tile.creatures)
         {
-            Creature *cr = ptr;  ptr = ptr->next;
-
             Position prev_pos = cr->pos;
             angle_t prev_angle = cr->angle;
-            uint64_t dead_energy = cr->execute_step(config);
+            uint64_t dead_energy;
+            if(res)
+            {
+                prev_pos = res->pos;  prev_angle = res->angle;  dead_energy = res++->dead_energy;
+            }
+            else dead_energy = cr->execute_step(config);
             if(dead_energy)
             {
-                *del_last = cr;  del_last = &cr->next;  // potential father
+                deleted.push_back(cr);  // potential father
                 spawn_meat(config, tile, prev_pos, dead_energy);  continue;
             }
 
@@ -1275,129 +1674,151 @@ void TileGroup::execute_step(const Config &config)
             for(const auto &womb : cr->wombs)if(womb.active)
             {
                 Creature *child = Creature::spawn(config, tile.rand, *cr,
-                    id++, prev_pos, prev_angle ^ flip_angle, womb.energy);
+                    id++, prev_pos, prev_angle ^ flip_angle, womb.energy, &pool, &brains);
                 uint64_t leftover = womb.energy;
                 if(child)
                 {
                     leftover -= child->passive_cost.initial + child->energy;
-                    tile.append(child);
+                    tile.children.push_back(child);  tile.creature_count++;
+                    tile.attack_count += child->attack_count;  allocs++;
                 }
                 spawn_meat(config, tile, prev_pos, leftover);
             }
         }
-        tile.children_count = id - next_id;  *tile.last = nullptr;
+        tile.children_count = id;  tile.creatures.clear();
+        uint32_t index = tile.x | (tile.y << config.order_x);
+        for(uint32_t k : tile.neighbors)buffers[k].mark(index);
     }
-    *del_last = nullptr;
+    parts.clear();  results.clear();  return allocs;
 }
 
-void TileGroup::consolidate(const std::vector<Reference> &layout, std::vector<TileGroup> &groups)
+void TileGroup::Tile::consolidate(std::vector<TileGroup> &groups)
 {
-    uint64_t n = 0;
-    for(const auto &ref : layout)
-    {
-        if(groups.data() + ref.group == this)tiles[ref.index].id_offset = n;
-        n += groups[ref.group].tiles[ref.index].children_count;
-    }
-    next_id += n;
+    size_t n = foods.size();
+    for(int i = 0; i < ref_count; i++)
+        n += groups[refs[i].group].buffers[refs[i].index].foods.size();
+    foods.reserve(n);
 
-    for(Creature *ptr = del_queue; ptr;)
-    {
-        Creature *cr = ptr;  ptr = ptr->next;  delete cr;
-    }
+    for(Creature *cr : children)cr->id += id_offset;
 
-    for(auto &tile : tiles)
+    struct Segment
     {
-        size_t n = tile.foods.size();
-        for(int i = 0; i < tile.ref_count; i++)
-        {
-            const auto &ref = tile.refs[i];
-            n += groups[ref.group].buffers[ref.index].foods.size();
-        }
-        tile.foods.reserve(n);
-
-        Creature *first_child = tile.first, **last_child = tile.last;
-        for(Creature *cr = first_child; cr; cr = cr->next)cr->id += tile.id_offset;
-
-        tile.last = &tile.first;
-        for(int i = 0; i < tile.ref_count; i++)
-        {
-            const auto &ref = tile.refs[i];
-            auto &buf = groups[ref.group].buffers[ref.index];
+        const TileBuffer *buf;
+        uint32_t food_beg, creature_beg;
+        const Source *end;
+    };
 
-            tile.foods.insert(tile.foods.end(), buf.foods.begin(), buf.foods.end());
-            tile.food_count += buf.food_count;
+    Segment seg[9];  int n_seg = 0;  // source tiles sorted by row-major index
+    for(int i = 0; i < ref_count; i++)
+    {
+        const auto &buf = groups[refs[i].group].buffers[refs[i].index];
+        food_count += buf.food_count;  creature_count += buf.creature_count;  attack_count += buf.attack_count;
 
-            if(!buf.creature_count)continue;
-            *tile.last = buf.first;  tile.last = buf.last;
-            tile.creature_count += buf.creature_count;
-            tile.attack_count += buf.attack_count;
-        }
-        if(first_child)
+        uint32_t food_beg = 0, creature_beg = 0;
+        for(const auto &src : buf.sources)
         {
-            *tile.last = first_child;  tile.last = last_child;
+            int k = n_seg++;  assert(n_seg <= 9);
+            for(; k && seg[k - 1].end->tile > src.tile; k--)seg[k] = seg[k - 1];
+            seg[k] = Segment{&buf, food_beg, creature_beg, &src};
+            food_beg = src.food_end;  creature_beg = src.creature_end;
         }
-        *tile.last = nullptr;
     }
+    for(int k = 0; k < n_seg; k++)
+    {
+        const Segment &cur = seg[k];
+        const Food *food = cur.buf->foods.data();
+        foods.insert(foods.end(), food + cur.food_beg, food + cur.end->food_end);
+        Creature *const *cr = cur.buf->creatures.data();
+        creatures.insert(creatures.end(), cr + cur.creature_beg, cr + cur.end->creature_end);
+    }
+    creatures.insert(creatures.end(), children.begin(), children.end());
+    children.clear();  targets.assign(creatures);  eaters.resize(foods.size());
 }
 
 
-void TileGroup::Tile::process_detectors(const Config &config,
-    const std::vector<TileGroup> &groups, const Reference &ref)
+void TileGroup::Tile::split(uint32_t count)  // into detector parts of equal creature count
+{
+    parts.clear();  credits.resize(9 * std::max(1u, count));
+    if(count < 2)return;
+
+    for(uint32_t i = 0; i <= count; i++)parts.push_back(uint64_t(creature_count) * i / count);
+}
+
+void TileGroup::Tile::process_detectors(const Config &config, const std::vector<TileGroup> &groups, const Reference &ref,
+    uint32_t first, uint32_t last, size_t food_first, size_t food_last)
 {
     const Tile &tile = groups[ref.group].tiles[ref.index];
+    const Targets &tg = tile.targets;  size_t n = tile.creatures.size();
 
-    for(Creature *cr = first; cr; cr = cr->next)
+    for(uint32_t k = first; k < last; k++)
     {
-        cr->process_food(tile.foods);
-        for(const Creature *tg = tile.first; tg; tg = tg->next)
-            if(tg != cr)cr->process_detectors(tg);
+        Creature *cr = creatures[k];  cr->process_food(tile.foods);
+        for(size_t i = 0; i < n; i++)if(tile.creatures[i] != cr)cr->process_detectors(tile.creatures[i], tg, i);
     }
 
-    for(const Creature *tg = tile.first; tg; tg = tg->next)
-        if(tg->flags & Creature::f_eating)tg->eat_food(foods);
+    for(size_t i = 0; i < n; i++)if(tg.flags[i] & Creature::f_eating)
+        tile.creatures[i]->eat_food(foods.data() + food_first, eaters.data() + food_first, food_last - food_first);
 
-    for(size_t i = spawn_start; i < foods.size(); i++)if(foods[i].type == Food::sprout)
+    for(size_t i = std::max<size_t>(spawn_start, food_first); i < food_last; i++)if(foods[i].type == Food::sprout)
         foods[i].check_grass(config, tile.foods.data(), tile.spawn_start);
 }
 
-void TileGroup::process_detectors(const Config &config,
-    const std::vector<Reference> &layout, const std::vector<TileGroup> &groups)
+void TileGroup::Tile::process_detectors(const Config &config,
+    const std::vector<Reference> &layout, const std::vector<TileGroup> &groups,
+    uint32_t part, uint32_t part_count)  // creatures and foods of the part, whole tile by default
 {
-    for(auto &tile : tiles)
+    uint32_t x1 = (x + 1) & config.mask_x, xm = (x - 1) & config.mask_x;
+    uint32_t y1 = (y + 1) & config.mask_y, ym = (y - 1) & config.mask_y;
+
+    uint32_t beg = part_count > 1 ? parts[part] : 0, end = part_count > 1 ? parts[part + 1] : creatures.size();
+    size_t food_beg = foods.size() * part / part_count, food_end = foods.size() * (part + 1) / part_count;
+    uint32_t index[] =
     {
-        uint32_t x = tile.x, y = tile.y;
-        uint32_t x1 = (x + 1) & config.mask_x, xm = (x - 1) & config.mask_x;
-        uint32_t y1 = (y + 1) & config.mask_y, ym = (y - 1) & config.mask_y;
+        xm | (ym << config.order_x), x | (ym << config.order_x), x1 | (ym << config.order_x),
+        xm | (y  << config.order_x), x | (y  << config.order_x), x1 | (y  << config.order_x),
+        xm | (y1 << config.order_x), x | (y1 << config.order_x), x1 | (y1 << config.order_x)
+    };
 
-        for(Creature *cr = tile.first; cr; cr = cr->next)cr->pre_process(config);
-        tile.process_detectors(config, groups, layout[xm | (ym << config.order_x)]);
-        tile.process_detectors(config, groups, layout[x  | (ym << config.order_x)]);
-        tile.process_detectors(config, groups, layout[x1 | (ym << config.order_x)]);
-        tile.process_detectors(config, groups, layout[xm | (y  << config.order_x)]);
-        tile.process_detectors(config, groups, layout[x  | (y  << config.order_x)]);
-        tile.process_detectors(config, groups, layout[x1 | (y  << config.order_x)]);
-        tile.process_detectors(config, groups, layout[xm | (y1 << config.order_x)]);
-        tile.process_detectors(config, groups, layout[x  | (y1 << config.order_x)]);
-        tile.process_detectors(config, groups, layout[x1 | (y1 << config.order_x)]);
-        for(Creature *cr = tile.first; cr; cr = cr->next)cr->post_process(config);
+    for(size_t i = food_beg; i < food_end; i++)eaters[i].reset(config.base_r2);
+    for(uint32_t k = beg; k < end; k++)creatures[k]->pre_process(config);
+    for(uint32_t k : index)process_detectors(config, groups, layout[k], beg, end, food_beg, food_end);
+    for(uint32_t k = beg; k < end; k++)creatures[k]->post_process(config);
 
-        for(auto &food : tile.foods)if(food.eater.target)
-            food.eater.target->food_energy += config.food_energy;
+    if(part_count == 1)credits.resize(9);  // otherwise by split()
+    auto *lists = &credits[9 * part];
+    for(uint32_t k = 0; k < 9; k++)lists[k].clear();
+    for(size_t i = food_beg; i < food_end; i++)if(eaters[i].target)
+    {
+        const Position &pos = eaters[i].target->pos;
+        uint32_t dx = (uint32_t(pos.x >> tile_order) - x + 1) & config.mask_x;
+        uint32_t dy = (uint32_t(pos.y >> tile_order) - y + 1) & config.mask_y;
+        assert(dx < 3 && dy < 3);  lists[dx + 3 * dy].push_back(Credit{eaters[i].target});
     }
 }
 
+void TileGroup::process_detectors(const Config &config,
+    const std::vector<Reference> &layout, const std::vector<TileGroup> &groups)
+{
+    for(auto &tile : tiles)tile.process_detectors(config, layout, groups);
+}
+
+
+#ifndef HEADLESS
 
 void TileGroup::Tile::update(const Config &config, uint64_t id, const Creature *&sel,
     FoodData *food_buf, CreatureData *creature_buf, SectorData *attack_buf) const
 {
+    uint64_t offs_x = uint64_t(x) << tile_order;
+    uint64_t offs_y = uint64_t(y) << tile_order;
+
     FoodData *food_ptr = food_buf;
     for(const auto &food : foods)if(food.type > Food::sprout)
-        (food_ptr++)->set(config, food);
+        (food_ptr++)->set(config, food.type, food.pos(offs_x, offs_y));
     assert(food_ptr == food_buf + food_count);
 
     CreatureData *creature_ptr = creature_buf;
     SectorData *attack_ptr = attack_buf;
-    for(const Creature *cr = first; cr; cr = cr->next)
+    for(const Creature *cr : creatures)
     {
         if(cr->id == id)sel = cr;
         (creature_ptr++)->set(config, *cr);
@@ -1413,24 +1834,25 @@ const Creature *TileGroup::update(const Config &config, uint64_t id,
     CreatureData *creature_buf, const std::vector<size_t> &creature_offs,
     SectorData *attack_buf, const std::vector<size_t> &attack_offs) const
 {
-    const Creature *sel = nullptr;
+    const Creature *sel = nullptr;  uint32_t index = first_tile;
     for(auto &tile : tiles)
     {
-        uint32_t index = tile.x | (tile.y << config.order_x);
         assert(food_offs[index + 1] - food_offs[index] == tile.food_count);
         assert(creature_offs[index + 1] - creature_offs[index] == tile.creature_count);
         assert(attack_offs[index + 1] - attack_offs[index] == tile.attack_count);
 
         tile.update(config, id, sel, food_buf + food_offs[index],
-            creature_buf + creature_offs[index], attack_buf + attack_offs[index]);
+            creature_buf + creature_offs[index], attack_buf + attack_offs[index]);  index++;
     }
     return sel;
 }
 
+#endif
+
 
 bool TileGroup::Tile::hit_test(const Position pos, uint64_t max_r2, const Creature *&sel, uint64_t prev_id) const
 {
-    for(const Creature *cr = first; cr; cr = cr->next)
+    for(const Creature *cr : creatures)
     {
         int32_t dx = cr->pos.x - pos.x;
         int32_t dy = cr->pos.y - pos.y;
@@ -1445,34 +1867,23 @@ bool TileGroup::Tile::hit_test(const Position pos, uint64_t max_r2, const Creatu
 
 void TileGroup::thread_proc(Context *context, uint32_t index)
 {
-    uint32_t stage = context->groups.size();
-    TileGroup &group = context->groups[index];
-    for(Context::Command cmd = context->first_wait(stage);;)switch(cmd)
+    for(;;)switch(context->wait_command(index))
     {
-    case Context::c_step:
-        group.execute_step(context->config);  context->barrier(stage);
-        group.consolidate(context->layout, context->groups);  context->barrier(stage);
-        group.process_detectors(context->config, context->layout, context->groups);
-        cmd = context->end_step(stage);  continue;
+    case Context::c_stop:
+        return;
 
-    case Context::c_draw:
-        {
-            const Creature *sel = group.update(context->config, context->sel_id,
-                context->food_buf, context->food_offs,
-                context->creature_buf, context->creature_offs,
-                context->attack_buf, context->attack_offs);
-            cmd = context->end_draw(stage, sel);  continue;
-        }
+    case Context::c_place:
+        context->place_groups(index);  context->end_command(index);  continue;
 
     default:
-        return;
+        context->run_tasks(index);  context->end_command(index);  continue;
     }
 }
 
 
 bool TileGroup::Tile::load(const Config &config, InStream &stream, uint64_t next_id, uint64_t *buf)
 {
-    assert(foods.empty() && !first);
+    assert(foods.empty() && creatures.empty());
     uint64_t offs_x = uint64_t(x) << tile_order;
     uint64_t offs_y = uint64_t(y) << tile_order;
 
@@ -1480,7 +1891,7 @@ bool TileGroup::Tile::load(const Config &config, InStream &stream, uint64_t next
     stream >> rand >> spawn_start >> creature_count;
     if(!stream)return false;  // TODO: check counts
 
-    foods.resize(spawn_start);  food_count = 0;
+    foods.resize(spawn_start);  eaters.resize(spawn_start);  food_count = 0;
     for(auto &food : foods)
     {
         if(!food.load(config, stream, offs_x, offs_y))return false;
@@ -1491,15 +1902,12 @@ bool TileGroup::Tile::load(const Config &config, InStream &stream, uint64_t next
     for(uint32_t i = 0; i < creature_count; i++)
     {
         Creature *cr = Creature::load(config, stream, next_id, buf);
-        if(!cr)
-        {
-            *last = nullptr;  return false;
-        }
-        *last = cr;  last = &cr->next;
+        if(!cr)return false;
+        creatures.push_back(cr);
         cr->pos.x |= offs_x;  cr->pos.y |= offs_y;
         attack_count += cr->attack_count;
     }
-    *last = nullptr;  return true;
+    targets.assign(creatures);  return true;
 }
 
 void TileGroup::Tile::save(OutStream &stream, uint64_t *buf) const
@@ -1511,98 +1919,730 @@ void TileGroup::Tile::save(OutStream &stream, uint64_t *buf) const
     stream << n << creature_count;
 
     for(auto &food : foods)if(food.type)stream << food;
-    for(Creature *cr = first; cr; cr = cr->next)cr->save(stream, buf);
+    for(const Creature *cr : creatures)cr->save(stream, buf);
+}
+
+
+
+// Barrier class
+
+inline void cpu_relax()
+{
+#if defined(BUILTIN) && (defined(__i386__) || defined(__x86_64__))
+    __builtin_ia32_pause();
+#endif
+}
+
+void Barrier::init(uint32_t n, uint32_t spin)
+{
+    count = sleepers = 0;  sense = 0;
+    total = n;  spin_count = spin;
+}
+
+bool Barrier::arrive(uint8_t &local_sense)
+{
+    local_sense ^= 1;
+    return count.fetch_add(1, std::memory_order_acq_rel) + 1 == total;
+}
+
+void Barrier::release(uint8_t local_sense)
+{
+    count.store(0, std::memory_order_relaxed);
+    sense.store(local_sense, std::memory_order_seq_cst);
+    if(!sleepers.load(std::memory_order_seq_cst))return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    cond.notify_all();
+}
+
+void Barrier::wait(uint8_t local_sense)
+{
+    for(uint32_t i = 0; i < spin_count; i++)
+    {
+        if(sense.load(std::memory_order_acquire) == local_sense)return;
+        cpu_relax();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    while(sense.load(std::memory_order_seq_cst) != local_sense)cond.wait(lock);
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+
+// TaskQueue class
+
+void TaskQueue::init(uint32_t size)
+{
+    uint32_t n = 1;
+    while(n < size)n <<= 1;
+    tasks = std::vector<std::atomic<uint64_t>>(n);  mask = n - 1;
+    top.store(0, std::memory_order_relaxed);
+    bottom.store(0, std::memory_order_relaxed);
+}
+
+bool TaskQueue::empty() const
+{
+    return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+}
+
+void TaskQueue::push(uint64_t task)
+{
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    assert(uint64_t(b - top.load(std::memory_order_relaxed)) <= mask);
+    tasks[b & mask].store(task, std::memory_order_relaxed);
+    bottom.store(b + 1, std::memory_order_release);
+}
+
+uint64_t TaskQueue::take()
+{
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if(t > b)
+    {
+        bottom.store(b + 1, std::memory_order_relaxed);  return no_task;
+    }
+
+    uint64_t task = tasks[b & mask].load(std::memory_order_relaxed);
+    if(t < b)return task;  // no contention with thieves
+
+    if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))task = no_task;
+    bottom.store(b + 1, std::memory_order_relaxed);  return task;
+}
+
+uint64_t TaskQueue::steal()
+{
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if(t >= b)return no_task;
+
+    uint64_t task = tasks[t & mask].load(std::memory_order_relaxed);
+    if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))return no_task;
+    return task;
 }
 
 
 
 // Context struct
 
+void Context::reset_tile(uint32_t index)
+{
+    const Reference &ref = layout[index];
+    tile_state[index].consolidate_wait.store(groups[ref.group].tiles[ref.index].ref_count + 1, std::memory_order_relaxed);
+    tile_state[index].detect_wait.store(9, std::memory_order_relaxed);
+}
+
+void Context::push_tasks(uint32_t index, uint64_t type)  // initial group tasks of the worker
+{
+    uint64_t n = groups.size();
+    uint32_t beg = index * n / thread_count, end = (index + 1) * n / thread_count;
+    while(end > beg)workers[index].queue.push(type | --end);  // lowest index is taken first
+}
+
+void Context::reset_step()  // both steps in flight if pipelined
+{
+    for(uint32_t i = 0; i < groups.size(); i++)
+    {
+        GroupScan &cur = group_scan[i];  uint32_t wait = i ? 2 : 1;
+        cur.wait[s_ids].store(wait, std::memory_order_relaxed);
+        cur.wait[s_counts].store(wait, std::memory_order_relaxed);
+        cur.tile_wait.store(groups[i].tiles.size(), std::memory_order_relaxed);
+    }
+    uint32_t parity = current_time & 1;
+    task_count[parity].store((pipelined ? 2 : 3) * groups.size() + 2 * layout.size(), std::memory_order_relaxed);
+    part_budget[parity].store(2 * layout.size(), std::memory_order_relaxed);
+    if(!pipelined)return;
+
+    // no count scan, one more task for the end of previous step
+    task_count[parity ^ 1].store(2 * groups.size() + 2 * layout.size() + 1, std::memory_order_relaxed);
+    part_budget[parity ^ 1].store(2 * layout.size(), std::memory_order_relaxed);
+    for(uint32_t i = 0; i < groups.size(); i++)
+        group_wait[i].store(groups[i].buffers.size(), std::memory_order_relaxed);
+}
+
+void Context::end_tasks(uint32_t index, uint32_t parity)  // called after the last task of a step
+{
+    if(cmd == c_step && pipelined && step_count > 1)  // next step is already running
+    {
+        current_time++;  step_count--;
+        if(step_count > 1)
+        {
+            task_count[parity].store(2 * groups.size() + 2 * layout.size() + 1, std::memory_order_relaxed);
+            part_budget[parity].store(2 * layout.size(), std::memory_order_relaxed);
+            for(uint32_t i = 0; i < groups.size(); i++)release_group(index, i);
+        }
+        if(task_count[parity ^ 1].fetch_sub(1, std::memory_order_acq_rel) == 1)end_tasks(index, parity ^ 1);
+        return;
+    }
+    if(cmd == c_step)  // other workers are idle
+    {
+        current_time++;  draw_step = false;
+        if(!pipelined)count_time = current_time;
+        stopped = until && until();
+        if(--step_count && !stopped)
+        {
+            reset_step();  generation.fetch_add(1, std::memory_order_release);
+            wake(true);  return;
+        }
+    }
+    running = false;  finish_time = std::chrono::steady_clock::now();
+    idle->active.fetch_sub(1, std::memory_order_acq_rel);
+    generation.fetch_add(1, std::memory_order_release);  wake(true);
+}
+
+void Context::push_task(uint32_t index, uint64_t task)
+{
+    workers[index].queue.push(task);  wake(false);
+}
+
+void Context::release(uint32_t index, std::atomic<uint32_t> &wait, uint64_t task)
+{
+    if(wait.fetch_sub(1, std::memory_order_acq_rel) == 1)push_task(index, task);
+}
+
+void Context::wake(bool all)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!idle->sleepers.load(std::memory_order_relaxed))return;
+
+    std::lock_guard<std::mutex> lock(idle->mutex);
+    if(all)idle->cond.notify_all();
+    else idle->cond.notify_one();
+}
+
+bool Context::has_tasks() const
+{
+    for(const auto &worker : workers)if(!worker.queue.empty())return true;
+    return false;
+}
+
+uint64_t Context::find_task(uint32_t index)  // own queue first, then steal from the same node, then others
+{
+    uint64_t task = workers[index].queue.take();  uint32_t node = workers[index].node;
+    for(uint32_t i = 1; task == no_task && i < 2 * thread_count; i++)
+    {
+        Worker &victim = workers[(index + i) % thread_count];
+        if((victim.node == node) == (i < thread_count))task = victim.queue.steal();
+    }
+    return task;
+}
+
+bool Context::next_generation(uint32_t index, uint32_t &gen)  // pushes own tasks of a new step, false if command is over
+{
+    if(generation.load(std::memory_order_acquire) == gen)return true;
+    gen++;  if(!running)return false;
+    push_tasks(index, t_step);  return true;
+}
+
+
+uint32_t Context::owner(uint32_t group) const  // worker that gets the group first in reset_tasks()
+{
+    uint64_t n = groups.size();
+    return ((group + 1) * uint64_t(thread_count) + n - 1) / n - 1;
+}
+
+void Context::place_groups(uint32_t index)
+{
+    uint64_t n = groups.size();
+    uint32_t beg = index * n / thread_count, end = (index + 1) * n / thread_count;
+    for(uint32_t i = beg; i < end; i++)groups[i].relocate();
+}
+
+
+void Context::scan(uint32_t index, uint32_t group, Scan type)  // group total or previous prefix is ready
+{
+    uint32_t beg = type == s_ids ? 0 : 1, end = type == s_ids ? 1 : 4;
+    for(; group < groups.size(); group++)  // resolved groups release their successors
+    {
+        GroupScan &cur = group_scan[group];
+        if(cur.wait[type].fetch_sub(1, std::memory_order_acq_rel) != 1)return;
+        if(pipelined)cur.wait[type].store(2, std::memory_order_relaxed);  // next step waits for this one
+        for(uint32_t i = beg; i < end; i++)
+        {
+            cur.base[i] = group ? group_scan[group - 1].prefix[i] : i ? 0 : groups[0].next_id;
+            cur.prefix[i] = cur.base[i] + cur.total[i];
+        }
+        if(type != s_ids || !hilbert)push_task(index, (type == s_ids ? t_ids : t_counts) | group);
+    }
+    if(type != s_ids)return;
+
+    if(hilbert)  // offsets follow row-major tile order like in row layout, so all groups are needed
+    {
+        uint64_t id = groups[0].next_id;
+        for(const auto &ref : layout)
+        {
+            auto &tile = groups[ref.group].tiles[ref.index];
+            tile.id_offset = id;  id += tile.children_count;
+        }
+        for(uint32_t i = 0; i < groups.size(); i++)
+        {
+            group_scan[i].base[0] = 0;  push_task(index, t_ids | i);
+        }
+    }
+    uint64_t next_id = group_scan.back().prefix[0];
+    for(auto &group : groups)group.next_id = next_id;
+    if(pipelined)scan(index, 0, s_ids);  // first group of the next step
+}
+
+void Context::assign_ids(uint32_t index, uint32_t group)  // offsets follow tile order, groups own consecutive tiles unless hilbert
+{
+    uint64_t total = 0;
+    for(auto &tile : groups[group].tiles)
+    {
+        tile.id_offset = total;  total += tile.children_count;
+    }
+    group_scan[group].total[0] = total;  scan(index, group, s_ids);
+}
+
+void Context::count_tiles(uint32_t index, uint32_t group)  // after consolidation, like assign_ids()
+{
+    size_t food_count = 0, creature_count = 0, attack_count = 0;  uint32_t k = groups[group].first_tile;
+    for(auto &tile : groups[group].tiles)
+    {
+        k++;  food_offs[k] = food_count += tile.food_count;
+        creature_offs[k] = creature_count += tile.creature_count;
+        attack_offs[k] = attack_count += tile.attack_count;
+    }
+    GroupScan &cur = group_scan[group];
+    cur.total[1] = food_count;  cur.total[2] = creature_count;  cur.total[3] = attack_count;
+    scan(index, group, s_counts);
+}
+
+void Context::release_group(uint32_t index, uint32_t group)  // wavefront: next execute_step() of the group
+{
+    auto &wait = group_wait[group];
+    if(wait.fetch_sub(1, std::memory_order_acq_rel) != 1)return;
+    wait.store(groups[group].buffers.size() + 1, std::memory_order_relaxed);
+    push_task(index, t_step | group);
+}
+
+void Context::finish_detect(uint32_t index, uint32_t tile)  // groups around the tile can go on
+{
+    if(!pipelined)return;
+    const Reference &ref = layout[tile];
+    if(group_time[ref.group] + 1 >= end_time)return;  // no more steps
+
+    const TileGroup::Tile &cur = groups[ref.group].tiles[ref.index];
+    for(int i = 0; i < cur.ref_count; i++)release_group(index, cur.refs[i].group);
+}
+
+uint32_t Context::split_parts(uint32_t creature_count, uint32_t parity)  // 1 if tile isn't hot or task budget is exhausted
+{
+    if(!split_size || creature_count < 2 * split_size)return 1;
+    int32_t count = std::min(creature_count / split_size, thread_count);
+    if(count < 2)return 1;
+
+    if(part_budget[parity].fetch_sub(count, std::memory_order_relaxed) >= count)return count;
+    part_budget[parity].fetch_add(count, std::memory_order_relaxed);  return 1;
+}
+
+uint32_t Context::task_parity(uint64_t task) const  // of the step the task belongs to
+{
+    uint32_t n = uint32_t(task);
+    switch(task & t_type_mask)
+    {
+    case t_step:
+        return (group_time[n] + 1) & 1;
+
+    case t_consolidate:  case t_detect:  case t_detect_part:
+        return group_time[layout[n].group] & 1;
+
+    case t_draw:
+        return 0;
+
+    default:
+        return group_time[n] & 1;
+    }
+}
+
+void Context::execute_task(uint32_t index, uint64_t task)
+{
+    uint32_t n = uint32_t(task), part = (task & ~t_type_mask) >> 32, parity = task_parity(task);
+    switch(task & t_type_mask)
+    {
+    case t_step:
+        group_time[n]++;
+#ifndef HEADLESS
+        if(draw_step)
+        {
+            const Creature *sel = groups[n].update(config, sel_id,
+                food_buf, food_offs, creature_buf, creature_offs, attack_buf, attack_offs);
+            if(sel)sel_state->set(*sel);  // before it changes
+        }
+#endif
+        {
+            TileGroup &group = groups[n];  uint32_t parts = 0;
+            group.collect_credits(config, layout, groups);
+            for(auto &tile : group.tiles)parts += group.add_parts(tile, split_parts(tile.creature_count, parity));
+            if(!parts)goto resume;
+
+            part_wait[n].store(parts, std::memory_order_relaxed);
+            task_count[parity].fetch_add(parts + 1, std::memory_order_relaxed);  // and resume
+            for(uint32_t i = parts; i--;)push_task(index, t_step_part | uint64_t(i) << 32 | n);
+            break;
+        }
+
+    case t_step_part:
+        groups[n].execute_part(config, part);
+        if(part_wait[n].fetch_sub(1, std::memory_order_acq_rel) == 1)push_task(index, t_resume | n);
+        break;
+
+    case t_resume:
+    resume:
+        {
+            uint64_t allocs = groups[n].execute_step(config, brains);
+            Worker &worker = workers[index];
+            auto &counter = worker.node == workers[owner(n)].node ? worker.local_allocs : worker.remote_allocs;
+            counter.store(counter.load(std::memory_order_relaxed) + allocs, std::memory_order_relaxed);
+        }
+        for(uint32_t k : groups[n].targets)release(index, tile_state[k].consolidate_wait, t_consolidate | k);
+        assign_ids(index, n);  if(groups[n].tiles.empty() && !pipelined)count_tiles(index, n);
+        break;
+
+    case t_ids:
+        for(auto &tile : groups[n].tiles)
+        {
+            tile.id_offset += group_scan[n].base[0];
+            uint32_t k = tile.x | (tile.y << config.order_x);
+            release(index, tile_state[k].consolidate_wait, t_consolidate | k);
+        }
+        break;
+
+    case t_counts:
+        for(uint32_t k = groups[n].first_tile + 1, end = k + groups[n].tiles.size(); k < end; k++)
+        {
+            food_offs[k] += group_scan[n].base[1];
+            creature_offs[k] += group_scan[n].base[2];
+            attack_offs[k] += group_scan[n].base[3];
+        }
+        break;
+
+    case t_consolidate:
+        {
+            groups[layout[n].group].tiles[layout[n].index].consolidate(groups);
+            uint32_t x = n & config.mask_x, y = n >> config.order_x;
+            for(uint32_t i = 0; i < 9; i++)
+            {
+                uint32_t k = ((x + i % 3 - 1) & config.mask_x) | ((y + i / 3 - 1) & config.mask_y) << config.order_x;
+                release(index, tile_state[k].detect_wait, t_detect | k);
+            }
+            uint32_t group = layout[n].group;  if(pipelined)break;  // offsets of the last step are counted later
+            if(group_scan[group].tile_wait.fetch_sub(1, std::memory_order_acq_rel) == 1)count_tiles(index, group);
+            break;
+        }
+
+    case t_detect:
+        {
+            TileGroup::Tile &tile = groups[layout[n].group].tiles[layout[n].index];
+            uint32_t parts = split_parts(tile.creature_count, parity);  tile.split(parts);
+            tile_state[n].part_wait.store(parts, std::memory_order_relaxed);
+            if(parts > 1)task_count[parity].fetch_add(parts - 1, std::memory_order_relaxed);
+            for(uint32_t i = parts; --i;)push_task(index, t_detect_part | uint64_t(i) << 32 | n);
+            tile.process_detectors(config, layout, groups, 0, parts);
+            reset_tile(n);
+        }
+        if(tile_state[n].part_wait.fetch_sub(1, std::memory_order_acq_rel) == 1)finish_detect(index, n);
+        break;
+
+    case t_detect_part:
+        {
+            TileGroup::Tile &tile = groups[layout[n].group].tiles[layout[n].index];
+            tile.process_detectors(config, layout, groups, part, tile.parts.size() - 1);
+        }
+        if(tile_state[n].part_wait.fetch_sub(1, std::memory_order_acq_rel) == 1)finish_detect(index, n);
+        break;
+
+#ifndef HEADLESS
+    case t_draw:
+        {
+            const Creature *sel = groups[n].update(config, sel_id,
+                food_buf, food_offs, creature_buf, creature_offs, attack_buf, attack_offs);
+            if(sel)Context::sel = sel;  // only one creature matches
+            break;
+        }
+#endif
+    }
+    if(task_count[parity].fetch_sub(1, std::memory_order_acq_rel) == 1)end_tasks(index, parity);
+}
+
+void Context::run_tasks(uint32_t index)
+{
+    Worker &worker = workers[index];
+    std::chrono::steady_clock::time_point start;
+    bool waiting = false;  uint32_t spin = 0;
+    for(uint32_t gen = 0; next_generation(index, gen);)
+    {
+        uint64_t task = find_task(index);
+        if(task != no_task)
+        {
+            if(waiting)add_sync_time(worker, start);
+            waiting = false;  spin = 0;
+            execute_task(index, task);  continue;
+        }
+
+        if(!waiting)start = std::chrono::steady_clock::now();  waiting = true;
+        if(spin++ < spin_count)
+        {
+            cpu_relax();  continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle->mutex);
+        idle->sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while(generation.load(std::memory_order_relaxed) == gen && !has_tasks())idle->cond.wait(lock);
+        idle->sleepers.fetch_sub(1, std::memory_order_relaxed);  spin = 0;
+    }
+    if(waiting)add_sync_time(worker, start);
+}
+
+
 void Context::start()
 {
-    stage = 0;  cmd = c_stop;
+    uint32_t size = 8 * groups.size() + 8 * layout.size();  // resumes, scans and part budget of two steps
+    workers = std::vector<Worker>(thread_count);
+    for(auto &worker : workers)
+    {
+        worker.queue.init(size);
+        worker.sync_time.store(0, std::memory_order_relaxed);
+        worker.local_allocs.store(0, std::memory_order_relaxed);
+        worker.remote_allocs.store(0, std::memory_order_relaxed);
+        worker.node = 0;  worker.cmd_sense = 0;
+    }
+    tile_state = std::vector<TileState>(layout.size());
+    part_wait = std::vector<std::atomic<uint32_t>>(groups.size());
+    group_wait = std::vector<std::atomic<uint32_t>>(groups.size());
+    group_time.resize(groups.size());
+    for(uint32_t i = 0; i < layout.size(); i++)reset_tile(i);
+    group_scan = std::vector<GroupScan>(groups.size());
+
+    task_count[0] = task_count[1] = generation = 0;  idle_state.sleepers = idle_state.active = 0;
+    step_count = 0;  running = stopped = false;
+    cmd_barrier.init(thread_count + 1, spin_count);
+    cmd_sense = 0;  cmd = c_none;
+}
+
+void Context::prepare(Command new_cmd)  // workers wait, so tasks can be pushed for them
+{
+    generation.store(0, std::memory_order_relaxed);
+    running = stopped = false;
+    switch(cmd = new_cmd)
+    {
+    case c_step:
+        pipelined = wavefront && step_count > 1 && !draw_step && !until;
+        for(auto &group : groups)if(group.tiles.empty())pipelined = false;
+        end_time = current_time + step_count;
+        std::fill(group_time.begin(), group_time.end(), current_time - 1);
+        reset_step();
+        for(uint32_t i = 0; i < thread_count; i++)push_tasks(i, t_step);
+        break;
+
+    case c_draw:
+        task_count[0].store(groups.size(), std::memory_order_relaxed);
+        for(uint32_t i = 0; i < thread_count; i++)push_tasks(i, t_draw);
+        break;
+
+    default:
+        return;
+    }
+    idle->active.fetch_add(1, std::memory_order_relaxed);  running = true;
 }
 
-void Context::pre_execute()
+void Context::begin(Command new_cmd)
 {
-    std::unique_lock<std::mutex> lock(mutex);
-    while(cmd)cond_cmd.wait(lock);  lock.release();
+    prepare(new_cmd);
+    if(cmd_barrier.arrive(cmd_sense))cmd_barrier.release(cmd_sense);
+    else cmd_barrier.wait(cmd_sense);
 }
 
-void Context::post_execute(Command new_cmd)
+void Context::finish()
 {
-    std::unique_lock<std::mutex> lock(mutex, std::adopt_lock);
-    if((cmd = new_cmd))cond_work.notify_all();
+    if(cmd_barrier.arrive(cmd_sense))cmd_barrier.release(cmd_sense);
+    else cmd_barrier.wait(cmd_sense);
+    cmd = c_none;
 }
 
 void Context::execute(Command new_cmd)
 {
-    std::unique_lock<std::mutex> lock(mutex);
-    while(cmd)cond_cmd.wait(lock);  cmd = new_cmd;
-    if(new_cmd)cond_work.notify_all();
+    begin(new_cmd);
+    if(new_cmd != c_stop)finish();
 }
 
+uint64_t Context::sync_time() const
+{
+    uint64_t res = 0;
+    for(const auto &worker : workers)res += worker.sync_time.load(std::memory_order_relaxed);
+    return res;
+}
 
-Context::Command Context::first_wait(uint32_t &target)
+void Context::alloc_counts(uint64_t &local, uint64_t &remote) const
 {
-    uint32_t n = groups.size();
-    std::unique_lock<std::mutex> lock(mutex);
-    if(++stage == target)
+    local = remote = 0;
+    for(const auto &worker : workers)
     {
-        cmd = c_none;  cond_cmd.notify_one();
+        local += worker.local_allocs.load(std::memory_order_relaxed);
+        remote += worker.remote_allocs.load(std::memory_order_relaxed);
     }
-    else while(stage - target >= n)cond_work.wait(lock);
-    while(!cmd)cond_work.wait(lock);
-    target += n;  return cmd;
 }
 
-void Context::barrier(uint32_t &target)
+void Context::pool_counts(uint64_t &fresh, uint64_t &reused, uint64_t &cached) const
 {
-    uint32_t n = groups.size();
-    std::unique_lock<std::mutex> lock(mutex);
-    if(++stage == target)cond_work.notify_all();
-    else while(stage - target >= n)cond_work.wait(lock);
-    target += n;
+    fresh = reused = cached = 0;
+    for(const auto &group : groups)
+    {
+        fresh += group.pool.fresh;  reused += group.pool.reused;  cached += group.pool.size;
+    }
 }
 
-Context::Command Context::end_step(uint32_t &target)
+static size_t heap_overhead(size_t size)  // of malloc chunk rounding
 {
-    uint32_t n = groups.size();
-    std::unique_lock<std::mutex> lock(mutex);
-    assert(cmd == c_step);
-    if(++stage == target)
+    return std::max<size_t>(4 * sizeof(size_t), (size + sizeof(size_t) + 15) & ~size_t(15)) - size;
+}
+
+template<typename T> static size_t heap_size(const std::vector<T> &vec)
+{
+    size_t size = vec.capacity() * sizeof(T);
+    return size ? size + heap_overhead(size) : 0;
+}
+
+static void add_genomes(Context::MemoryUsage::Bytes &bytes, std::vector<const Genome *> &genomes)
+{
+    std::sort(genomes.begin(), genomes.end());  // interned, shared by pointer
+    genomes.erase(std::unique(genomes.begin(), genomes.end()), genomes.end());
+    for(const Genome *genome : genomes)
     {
-        current_time++;  cmd = c_none;
-        cond_cmd.notify_one();
+        size_t chromosomes = genome->chromosomes.capacity() * sizeof(uint32_t);
+        size_t genes = genome->genes.capacity() * sizeof(Genome::Gene);
+        bytes.genomes += sizeof(Genome) + chromosomes + genes;
+        bytes.overhead += heap_overhead(sizeof(Genome)) + heap_overhead(chromosomes) + heap_overhead(genes);
     }
-    else while(stage - target >= n)cond_work.wait(lock);
-    while(!cmd)cond_work.wait(lock);
-    target += n;  return cmd;
 }
 
-Context::Command Context::end_draw(uint32_t &target, const Creature *cr)
+void Context::memory_usage(MemoryUsage &usage) const
 {
-    uint32_t n = groups.size();
-    std::unique_lock<std::mutex> lock(mutex);
-    assert(cmd == c_draw);  if(cr)sel = cr;
-    if(++stage == target)
+    usage = MemoryUsage();  std::vector<const Genome *> genomes, local;
+    for(const auto &group : groups)
     {
-        cmd = c_none;  cond_cmd.notify_one();
+        for(const auto &tile : group.tiles)
+        {
+            MemoryUsage::Bytes cur = MemoryUsage::Bytes();
+            cur.food_count = tile.foods.size();  cur.creature_count = tile.creatures.size();
+            cur.foods = heap_size(tile.foods) + heap_size(tile.eaters);
+
+            cur.tiles = sizeof(TileGroup::Tile) + heap_size(tile.creatures) + heap_size(tile.children);
+            cur.tiles += heap_size(tile.parts) + heap_size(tile.credits);
+            for(const auto &list : tile.credits)cur.tiles += heap_size(list);
+            cur.tiles += heap_size(tile.targets.x) + heap_size(tile.targets.y) + heap_size(tile.targets.id);
+            cur.tiles += heap_size(tile.targets.claw_r2) + heap_size(tile.targets.angle) + heap_size(tile.targets.flags);
+
+            local.clear();
+            for(const Creature *cr : tile.creatures)
+            {
+                cur.objects += sizeof(Creature);  cur.brains += cr->size - sizeof(Creature);
+                cur.overhead += heap_overhead(cr->size);  local.push_back(cr->genome.get());
+            }
+            genomes.insert(genomes.end(), local.begin(), local.end());
+
+            usage.world.food_count += cur.food_count;  usage.world.creature_count += cur.creature_count;
+            usage.world.tiles += cur.tiles;  usage.world.foods += cur.foods;
+            usage.world.objects += cur.objects;  usage.world.brains += cur.brains;
+            usage.world.overhead += cur.overhead;  // genomes are counted once for world
+
+            add_genomes(cur, local);
+            if(!usage.tile_count++ || cur.total() > usage.largest.total())
+            {
+                usage.largest = cur;  usage.largest_tile = tile.x | (tile.y << config.order_x);
+            }
+        }
+        usage.world.overhead += group.pool.memory + group.pool.size * heap_overhead(pool_granule);  // same for granule multiples
     }
-    else while(stage - target >= n)cond_work.wait(lock);
-    while(!cmd)cond_work.wait(lock);
-    target += n;  return cmd;
+    add_genomes(usage.world, genomes);  // sorted and unique after
+
+    size_t table = brains.table_size();  usage.world.cache = table + heap_overhead(table);
+    local.clear();
+    brains.for_each([&](const Genome &genome, const GenomeProcessor &proc)
+    {
+        size_t object = sizeof(GenomeProcessor) + 16;  // with make_shared control block
+        usage.world.cache += object + heap_overhead(object) + heap_size(proc.slots) + heap_size(proc.links);
+        if(!std::binary_search(genomes.begin(), genomes.end(), &genome))local.push_back(&genome);
+    });
+    MemoryUsage::Bytes held = MemoryUsage::Bytes();  add_genomes(held, local);
+    usage.world.cache += held.genomes + held.overhead;
+}
+
+void Context::add_sync_time(Worker &worker, std::chrono::steady_clock::time_point start)
+{
+    uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    worker.sync_time.store(worker.sync_time.load(std::memory_order_relaxed) + time, std::memory_order_relaxed);
+}
+
+
+Context::Command Context::wait_command(uint32_t index)
+{
+    Worker &worker = workers[index];
+    if(cmd_barrier.arrive(worker.cmd_sense))cmd_barrier.release(worker.cmd_sense);
+    else cmd_barrier.wait(worker.cmd_sense);
+    return cmd;
+}
+
+void Context::end_command(uint32_t index)
+{
+    Worker &worker = workers[index];
+    auto start = std::chrono::steady_clock::now();
+    if(cmd_barrier.arrive(worker.cmd_sense))cmd_barrier.release(worker.cmd_sense);
+    else cmd_barrier.wait(worker.cmd_sense);
+    add_sync_time(worker, start);
 }
 
 
 
 // World struct
 
+std::vector<uint32_t> allowed_cpus()
+{
+    std::vector<uint32_t> cpus;
+#ifdef __linux__
+    cpu_set_t set;  CPU_ZERO(&set);
+    if(!sched_getaffinity(0, sizeof(set), &set))
+        for(uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++)if(CPU_ISSET(cpu, &set))cpus.push_back(cpu);
+#endif
+    return cpus;
+}
+
+uint32_t pin_thread(std::thread &thread, uint32_t cpu)  // returns NUMA node of the cpu
+{
+    uint32_t node = 0;
+#ifdef __linux__
+    cpu_set_t set;  CPU_ZERO(&set);  CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+
+    char path[64];  std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+    if(DIR *dir = opendir(path))
+    {
+        while(dirent *entry = readdir(dir))
+            if(std::sscanf(entry->d_name, "node%u", &node) == 1)break;
+        closedir(dir);
+    }
+#endif
+    return node;
+}
+
 const char version_string[] = "Evol0004";
 
 
-World::World(uint32_t group_count) : group_count(group_count)
+World::World(uint32_t thread_count, uint32_t group_count)
 {
+    Context::thread_count = thread_count ? thread_count : default_thread_count();
+    World::group_count = group_count ? group_count : Context::thread_count * groups_per_thread;
+    rebalance_period = default_rebalance_period;
+    pin_threads = stepping = hilbert = false;
+    draw_step = false;  idle = &idle_state;
+    split_size = default_split_size;  count_time = -1;
+    wavefront = pipelined = false;
+    spin_count = Context::thread_count <= std::thread::hardware_concurrency() ? default_spin_count : 0;
 }
 
 World::~World()
@@ -1610,10 +2650,16 @@ World::~World()
     if(!threads.empty())stop();
 }
 
+uint32_t World::default_thread_count()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
 
-void World::init()
+
+void World::init(uint64_t seed, uint8_t order)
 {
-    config.order_x = config.order_y = 6;  // 64 x 64
+    brains.clear();
+    config.order_x = config.order_y = order;  // 64 x 64 by default
     config.base_radius = tile_size / 64;
 
     config.chromosome_bits = 4;  // 16 = 8 pair
@@ -1666,7 +2712,6 @@ void World::init()
     assert(res);  (void)res;
 
 
-    uint64_t seed = 1234;
     uint32_t exp_grass_gen    = uint32_t(-1) >> 8;
     uint32_t exp_creature_gen = uint32_t(-1) >> 4;
     int grass_gen_mul = 16;
@@ -1689,9 +2734,9 @@ void World::init()
         {
             uint64_t xx = (tile.rand.uint32() & tile_mask) | offs_x;
             uint64_t yy = (tile.rand.uint32() & tile_mask) | offs_y;
-            tile.foods.emplace_back(config, Food::grass, Position{xx, yy});
+            tile.foods.emplace_back(Food::grass, Position{xx, yy});
         }
-        tile.spawn_start = tile.food_count = n;
+        tile.spawn_start = tile.food_count = n;  tile.eaters.resize(n);
 
         n = tile.rand.poisson(exp_creature_gen);
         for(uint32_t k = 0; k < n; k++)
@@ -1700,26 +2745,26 @@ void World::init()
             uint64_t xx = (tile.rand.uint32() & tile_mask) | offs_x;
             uint64_t yy = (tile.rand.uint32() & tile_mask) | offs_y;
             Genome genome(config, tile.rand, init_genome, nullptr);
-            Creature *cr = Creature::spawn(config, genome,
-                next_id++, Position{xx, yy}, angle, uint64_t(-1));
-            *tile.last = cr;  tile.last = &cr->next;
+            Creature *cr = Creature::spawn(config, GenomePool::instance().intern(std::move(genome)),
+                next_id++, Position{xx, yy}, angle, uint64_t(-1), nullptr, &brains);
+            tile.creatures.push_back(cr);
         }
-        *tile.last = nullptr;  tile.creature_count = n;  tile.attack_count = 0;
+        tile.creature_count = n;  tile.attack_count = 0;  tile.targets.assign(tile.creatures);
     }
     for(auto &group : groups)
     {
         group.next_id = next_id;
         group.process_detectors(config, layout, groups);
     }
-    current_time = 0;
+    current_time = 0;  count_time = -1;
 }
 
-void World::build_layout()
+void World::build_layout(const uint64_t *cost)
 {
-    TileLayout scheme(config.mask_x + 1, config.mask_y + 1, group_count);
+    TileLayout scheme(config.mask_x + 1, config.mask_y + 1, group_count, cost, hilbert);
     scheme.build_layout();
 
-    groups.resize(group_count);
+    std::vector<TileGroup>(group_count).swap(groups);  // TileGroup is not movable
     for(uint32_t i = 0; i < group_count; i++)groups[i].alloc(scheme.groups[i]);
 
     layout.resize(scheme.tiles.size());
@@ -1731,6 +2776,8 @@ void World::build_layout()
 
         tile.x = i & config.mask_x;
         tile.y = i >> config.order_x;
+        for(int k = 0; k < tile.ref_count; k++)
+            groups[tile.refs[k].group].targets[tile.refs[k].index] = i;
     }
 
     food_offs.resize(layout.size() + 1);
@@ -1738,45 +2785,113 @@ void World::build_layout()
     attack_offs.resize(layout.size() + 1);
 }
 
+void World::rebalance()  // between steps only, doesn't affect simulation
+{
+    std::vector<uint64_t> cost(layout.size());
+    for(size_t i = 0; i < layout.size(); i++)
+    {
+        const Tile &tile = get_tile(i);
+        uint64_t creatures = 0, foods = 0;
+        for(uint32_t k = 0; k < 9; k++)
+        {
+            uint32_t x = (tile.x + k % 3 - 1) & config.mask_x, y = (tile.y + k / 3 - 1) & config.mask_y;
+            const Tile &neighbor = get_tile(x | (y << config.order_x));
+            creatures += neighbor.creature_count;  foods += neighbor.foods.size();
+        }
+        // in units of creature-food checks in detectors
+        cost[i] = 1 + 4 * tile.foods.size() + tile.creature_count * (128 + 4 * creatures + foods);
+    }
+
+    std::vector<TileGroup> prev_groups;  prev_groups.swap(groups);
+    std::vector<Reference> prev_layout;  prev_layout.swap(layout);
+    uint64_t next_id = prev_groups[0].next_id;
+    build_layout(cost.data());
+    for(size_t i = 0; i < layout.size(); i++)
+        groups[layout[i].group].tiles[layout[i].index].move(
+            prev_groups[prev_layout[i].group].tiles[prev_layout[i].index]);
+    for(uint32_t i = 0; i < group_count; i++)groups[i].pool.swap(prev_groups[i].pool);
+    for(auto &group : groups)group.next_id = next_id;
+    for(uint32_t i = 0; i < tile_state.size(); i++)reset_tile(i);
+    if(pin_threads && !threads.empty())execute(c_place);
+}
+
 
 void World::start()
 {
     assert(threads.empty());
 
     Context::start();
-    threads.reserve(group_count);
-    for(uint32_t i = 0; i < group_count; i++)
+    std::vector<uint32_t> cpus;
+    if(pin_threads)cpus = allowed_cpus();
+    threads.reserve(thread_count);
+    for(uint32_t i = 0; i < thread_count; i++)
+    {
         threads.emplace_back(TileGroup::thread_proc, this, i);
-    pre_execute();
+        if(!cpus.empty())workers[i].node = pin_thread(threads[i], cpus[i % cpus.size()]);
+    }
+    if(!cpus.empty())execute(c_place);  // first touch from the owning workers
+}
+
+void World::start_step()
+{
+    finish_step();  draw_step = false;
+    step_count = 1;  begin(c_step);  stepping = true;
+}
+
+bool World::finish_step()  // returns false if there was no step in progress
+{
+    if(!stepping)return false;
+    finish();  stepping = false;
+    if(rebalance_period && !(current_time % rebalance_period))rebalance();
+    return true;
 }
 
 void World::next_step()
 {
-    post_execute(c_step);  pre_execute();
+    start_step();  finish_step();
+}
+
+uint64_t World::run(uint64_t n, const std::function<bool()> &until)  // stops early if until() returns true
+{
+    finish_step();  draw_step = false;
+    uint64_t start = current_time, end = start + n;
+    for(Context::until = until; current_time < end && !stopped;)
+    {
+        step_count = end - current_time;  // workers don't rebalance
+        if(rebalance_period)step_count = std::min(step_count, rebalance_period - current_time % rebalance_period);
+        execute(c_step);
+        if(rebalance_period && !(current_time % rebalance_period))rebalance();
+    }
+    Context::until = nullptr;  stopped = false;
+    return current_time - start;
 }
 
 void World::stop()
 {
-    post_execute(c_stop);
+    finish_step();
+    execute(c_stop);
     for(auto &thread : threads)thread.join();
     threads.clear();
 }
 
 
-void World::count_objects()
+void World::count_objects()  // steps compute offsets themselves
 {
+    if(count_time == current_time)return;
+
     food_offs[0] = creature_offs[0] = attack_offs[0] = 0;
-    size_t food_count = 0, creature_count = 0, attack_count = 0;
-    for(size_t i = 0; i < layout.size(); i++)
+    size_t food_count = 0, creature_count = 0, attack_count = 0, i = 0;
+    for(auto &group : groups)for(auto &tile : group.tiles)
     {
-        Tile &tile = groups[layout[i].group].tiles[layout[i].index];
-
-        food_offs[i + 1] = food_count += tile.food_count;
-        creature_offs[i + 1] = creature_count += tile.creature_count;
-        attack_offs[i + 1] = attack_count += tile.attack_count;
+        food_offs[++i] = food_count += tile.food_count;
+        creature_offs[i] = creature_count += tile.creature_count;
+        attack_offs[i] = attack_count += tile.attack_count;
     }
+    count_time = current_time;
 }
 
+#ifndef HEADLESS
+
 const Creature *World::update(FoodData *food_buf, CreatureData *creature_buf, SectorData *attack_buf, uint64_t sel_id)
 {
     // count_objects() should be called prior
@@ -1787,9 +2902,24 @@ const Creature *World::update(FoodData *food_buf, CreatureData *creature_buf, Se
     Context::creature_buf = creature_buf;
     Context::attack_buf = attack_buf;
 
-    post_execute(c_draw);  pre_execute();  return sel;
+    execute(c_draw);  return sel;
+}
+
+void World::start_step(FoodData *food_buf, CreatureData *creature_buf, SectorData *attack_buf,
+    uint64_t sel_id, CreatureState &sel)  // count_objects() should be called prior
+{
+    finish_step();
+    Context::sel_id = sel_id;  sel_state = &sel;
+    Context::food_buf = food_buf;
+    Context::creature_buf = creature_buf;
+    Context::attack_buf = attack_buf;
+
+    draw_step = true;  step_count = 1;
+    begin(c_step);  stepping = true;
 }
 
+#endif
+
 
 const Creature *World::hit_test(const Position &pos, uint32_t rad, uint64_t prev_id) const
 {
@@ -1815,7 +2945,7 @@ bool World::load(InStream &stream)
     uint64_t next_id;  stream >> config >> align(8) >> current_time >> next_id;
     if(!stream)return false;
 
-    build_layout();
+    brains.clear();  build_layout();
     std::vector<uint64_t> buf(std::max<uint32_t>(1, config.slot_bits >> 6));
     for(size_t i = 0; i < layout.size(); i++)
     {
@@ -1827,17 +2957,170 @@ bool World::load(InStream &stream)
         group.next_id = next_id;
         group.process_detectors(config, layout, groups);
     }
-    return true;
+    count_time = -1;  return true;
 }
 
-void World::save(OutStream &stream) const
+void World::save_header(OutStream &stream) const
 {
     stream.assert_align(8);  stream.put(version_string, 8);
     stream << config << align(8) << current_time << groups[0].next_id;
+}
+
+void World::save_tiles(OutStream &stream, uint32_t first, uint32_t last) const
+{
     std::vector<uint64_t> buf(std::max<uint32_t>(1, config.slot_bits >> 6));
-    for(size_t i = 0; i < layout.size(); i++)
+    for(uint32_t i = first; i < last; i++)get_tile(i).save(stream, buf.data());
+}
+
+void World::save(OutStream &stream) const
+{
+    save_header(stream);  save_tiles(stream, 0, layout.size());
+}
+
+
+
+// Ensemble struct
+
+Ensemble::Ensemble(uint32_t thread_count)
+{
+    Ensemble::thread_count = thread_count ? thread_count : World::default_thread_count();
+    spin_count = Ensemble::thread_count <= std::thread::hardware_concurrency() ? default_spin_count : 0;
+}
+
+Ensemble::~Ensemble()
+{
+    if(!threads.empty())stop();
+}
+
+World &Ensemble::add(uint32_t group_count)
+{
+    assert(threads.empty());
+    worlds.emplace_back(new World(thread_count, group_count));
+    return *worlds.back();
+}
+
+
+void Ensemble::start()
+{
+    assert(threads.empty());
+
+    for(auto &world : worlds)
+    {
+        world->Context::start();  world->idle = &idle;
+    }
+    steps.assign(worlds.size(), 0);  elapsed.assign(worlds.size(), 0);
+    idle.sleepers = idle.active = 0;
+    cmd_barrier.init(thread_count + 1, spin_count);
+    cmd_sense = 0;  cmd = Context::c_none;
+
+    threads.reserve(thread_count);
+    for(uint32_t i = 0; i < thread_count; i++)threads.emplace_back(thread_proc, this, i);
+}
+
+void Ensemble::run(uint64_t n)  // advances every world n steps, rebalancing each at its own period
+{
+    std::vector<uint64_t> end(worlds.size()), count(worlds.size());
+    for(size_t k = 0; k < worlds.size(); k++)end[k] = worlds[k]->current_time + n;
+    for(;;)
     {
-        const Tile &tile = groups[layout[i].group].tiles[layout[i].index];
-        tile.save(stream, buf.data());
+        bool active = false;
+        for(size_t k = 0; k < worlds.size(); k++)
+        {
+            World &world = *worlds[k];
+            world.step_count = count[k] = end[k] - world.current_time;
+            if(world.rebalance_period)world.step_count = count[k] =
+                std::min(count[k], world.rebalance_period - world.current_time % world.rebalance_period);
+            world.prepare(count[k] ? Context::c_step : Context::c_none);  active |= world.running;
+        }
+        if(!active)break;
+
+        auto start = std::chrono::steady_clock::now();
+        execute(Context::c_step);
+        for(size_t k = 0; k < worlds.size(); k++)
+        {
+            World &world = *worlds[k];
+            if(world.cmd == Context::c_none)continue;
+
+            world.cmd = Context::c_none;  steps[k] += count[k];
+            elapsed[k] += std::chrono::duration<double>(world.finish_time - start).count();
+            if(world.rebalance_period && !(world.current_time % world.rebalance_period))world.rebalance();
+        }
     }
 }
+
+void Ensemble::stop()
+{
+    execute(Context::c_stop);
+    for(auto &thread : threads)thread.join();
+    threads.clear();
+}
+
+
+void Ensemble::sync(uint8_t &local_sense)
+{
+    if(cmd_barrier.arrive(local_sense))cmd_barrier.release(local_sense);
+    else cmd_barrier.wait(local_sense);
+}
+
+void Ensemble::execute(Context::Command new_cmd)
+{
+    cmd = new_cmd;  sync(cmd_sense);
+    if(new_cmd != Context::c_stop)sync(cmd_sense);
+}
+
+void Ensemble::run_tasks(uint32_t index, std::vector<uint32_t> &gen)  // like Context::run_tasks over all worlds
+{
+    std::fill(gen.begin(), gen.end(), 0);
+    size_t cur = index % worlds.size();  uint32_t spin = 0;
+    while(idle.active.load(std::memory_order_acquire))
+    {
+        for(size_t k = 0; k < worlds.size(); k++)  // any world can start a new step
+            worlds[k]->next_generation(index, gen[k]);
+
+        uint64_t task = no_task;  // stay with the last world while it has tasks
+        for(size_t k = 0; k < worlds.size(); k++, cur = (cur + 1) % worlds.size())
+            if((task = worlds[cur]->find_task(index)) != no_task)break;
+        if(task != no_task)
+        {
+            spin = 0;  worlds[cur]->execute_task(index, task);  continue;
+        }
+
+        if(spin++ < spin_count)
+        {
+            cpu_relax();  continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle.mutex);
+        idle.sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for(bool ready = false; !ready && idle.active.load(std::memory_order_relaxed);)
+        {
+            for(size_t k = 0; !ready && k < worlds.size(); k++)
+                ready = worlds[k]->generation.load(std::memory_order_relaxed) != gen[k] || worlds[k]->has_tasks();
+            if(!ready)idle.cond.wait(lock);
+        }
+        idle.sleepers.fetch_sub(1, std::memory_order_relaxed);  spin = 0;
+    }
+}
+
+void Ensemble::thread_proc(Ensemble *ensemble, uint32_t index)
+{
+    std::vector<uint32_t> gen(ensemble->worlds.size());
+    for(uint8_t sense = 0;;)
+    {
+        ensemble->sync(sense);
+        if(ensemble->cmd == Context::c_stop)return;
+        ensemble->run_tasks(index, gen);  ensemble->sync(sense);
+    }
+}
+
+
+
+void print_checksum(const World &world, const OutStream &stream)
+{
+    const uint32_t *checksum = static_cast<const uint32_t *>(stream.checksum());
+    std::printf("Time: %llu, Checksum:", (unsigned long long)world.current_time);
+    for(unsigned i = 0; i < Hash::result_size / 4; i++)
+        std::printf(" %08lX", (unsigned long)bswap32(checksum[i]));
+    std::printf("\n");
+}
@@ -7,8 +7,13 @@
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <type_traits>
 
 
 
@@ -33,6 +38,18 @@ namespace Slot
 
 constexpr uint8_t slot_type_bits = 4;
 constexpr uint8_t flag_bits = 6;
+constexpr uint32_t max_thread_count = 1024;
+constexpr uint32_t max_group_count = 1ul << 16;
+constexpr uint32_t groups_per_thread = 4;
+constexpr uint32_t default_spin_count = 1ul << 12;
+constexpr uint32_t default_rebalance_period = 64;
+constexpr uint32_t default_split_size = 64;
+constexpr uint32_t max_pool_size = 1ul << 12;  // cached creatures per group
+constexpr uint32_t pool_granule = 16;  // creature allocation sizes are rounded to this
+constexpr uint32_t pool_class_count = 128;  // cached sizes up to pool_granule * pool_class_count
+constexpr uint32_t pool_class_slack = 4;  // larger size classes tried for allocation
+constexpr uint32_t brain_cache_bits = 12;  // log2 of processed genomes kept per world
+constexpr uint64_t no_task = uint64_t(-1);
 
 typedef uint8_t slot_t;
 
@@ -82,6 +99,7 @@ struct Config
 
 
 struct Creature;
+struct CreaturePool;
 
 struct Detector
 {
@@ -92,6 +110,18 @@ struct Detector
     explicit Detector(uint64_t r2);
     void reset(uint64_t r2);
     void update(uint64_t r2, const Creature *cr);
+    void update(uint64_t r2, uint64_t id, const Creature *cr);
+};
+
+struct Targets  // detector-relevant fields of tile creatures in list order
+{
+    std::vector<uint64_t> x, y, id, claw_r2;
+    std::vector<angle_t> angle;
+    std::vector<uint8_t> flags;
+
+    void assign(const std::vector<Creature *> &creatures);
+    void swap(Targets &targets);
+    void clear();
 };
 
 
@@ -100,21 +130,25 @@ struct Position
     uint64_t x, y;
 };
 
-struct Food
+struct Food  // eater is kept separately in Tile::eaters
 {
     enum Type
     {
         dead, sprout, grass, meat
     };
 
+    uint32_t x, y;  // low bits of position, enough for distances
     Type type;
-    Position pos;
-    Detector eater;
 
     Food() = default;
-    Food(const Config &config, Type type, const Position &pos);
-    Food(const Config &config, const Food &food);
-    void set(const Config &config, const Food &food);
+    Food(Type type, const Position &pos) : x(pos.x), y(pos.y), type(type)
+    {
+    }
+
+    Position pos(uint64_t offs_x, uint64_t offs_y) const  // offsets of containing tile
+    {
+        return Position{x & tile_mask | offs_x, y & tile_mask | offs_y};
+    }
 
     void check_grass(const Config &config, const Food *food, size_t n);
 
@@ -148,6 +182,11 @@ struct Genome
         {
             return data < cmp.data;
         }
+
+        bool operator == (const Gene &cmp) const
+        {
+            return data == cmp.data;
+        }
     };
 
     std::vector<uint32_t> chromosomes;
@@ -156,11 +195,46 @@ struct Genome
     Genome() = default;
     explicit Genome(const Config &config);
     Genome(const Config &config, Random &rand, const Genome &parent, const Genome *father);
+    bool init(const Config &config, Random &rand, const Genome &parent, const Genome *father);
+
+    uint64_t digest() const;
+    bool operator == (const Genome &cmp) const;
 
     bool load(const Config &config, InStream &stream);
     void save(OutStream &stream) const;
 };
 
+typedef std::shared_ptr<const Genome> GenomeRef;
+
+class GenomePool  // hash-consing, identical genomes of all creatures are stored once
+{
+    static constexpr uint32_t shard_bits = 6;  // of digest, select lock
+
+    struct Entry
+    {
+        const Genome *genome;
+        std::weak_ptr<const Genome> ref;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_multimap<uint64_t, Entry> genomes;  // by digest
+    };
+
+    Shard shards[1u << shard_bits];
+    std::atomic<uint64_t> unique_count, gene_count;
+
+    GenomePool();
+    void release(const Genome *genome, uint64_t digest);
+
+public:
+    static GenomePool &instance();
+
+    GenomeRef intern(Genome &&genome);
+    void counts(uint64_t &unique, uint64_t &genes) const;
+};
+
 
 class GenomeProcessor
 {
@@ -254,6 +328,106 @@ public:
     void process(const Config &config, const Genome &genome);
 };
 
+class Scratch  // per-thread temporaries of genome crossover, processing and creature construction
+{
+    static std::atomic<uint64_t> allocs;  // outermost leases that had to grow some buffer
+    uint32_t depth;  // of nested leases
+
+    Scratch() : depth(0)
+    {
+    }
+
+    static Scratch &local();
+    size_t capacity() const;
+
+public:
+    struct Sequence
+    {
+        const Genome::Gene *start;
+        size_t count;  uint32_t next;
+
+        Sequence(const Genome::Gene *start, size_t count) : start(start), count(count), next(-1)
+        {
+        }
+    };
+
+    struct Reference
+    {
+        uint32_t source, target;
+        int32_t weight;
+
+        explicit Reference(uint32_t source) : source(source)
+        {
+        }
+
+        Reference(uint32_t target, const GenomeProcessor::LinkData &link) :
+            source(link.source), target(target), weight(link.weight)
+        {
+        }
+
+        bool operator < (const Reference &cmp) const
+        {
+            return source < cmp.source;
+        }
+    };
+
+    class Lease  // scratch of current thread, counts allocations on release of outermost
+    {
+        size_t capacity;
+
+    public:
+        Scratch &scratch;
+
+        Lease();
+        ~Lease();
+    };
+
+    std::vector<Sequence> seqs;  // Genome::init()
+    std::vector<uint8_t> pairs;
+    std::vector<uint32_t> last, flips;
+
+    std::vector<Genome::Gene> genes;  // GenomeProcessor::process()
+    std::vector<uint32_t> queue, ref_pos;
+    std::vector<Reference> refs;
+
+    std::vector<slot_t> slots;  // Creature::Creature()
+    std::vector<uint32_t> mapping;
+
+    static uint64_t alloc_count();
+};
+
+class BrainCache  // direct-mapped by genome digest, holds genomes to keep their identity
+{
+    static constexpr uint32_t lock_bits = 6;
+
+    struct Entry
+    {
+        GenomeRef genome;
+        std::shared_ptr<const GenomeProcessor> proc;
+    };
+
+    std::vector<Entry> entries;
+    std::mutex locks[1u << lock_bits];
+    std::atomic<uint64_t> hits, misses;
+
+public:
+    BrainCache();
+
+    std::shared_ptr<const GenomeProcessor> get(const Config &config, const GenomeRef &genome);
+    void counts(uint64_t &hit_count, uint64_t &miss_count) const;
+    void clear();
+
+    size_t table_size() const
+    {
+        return entries.capacity() * sizeof(Entry);
+    }
+
+    template<typename F> void for_each(F func) const  // held genomes and processors, no get() in progress
+    {
+        for(const auto &entry : entries)if(entry.proc)func(*entry.genome, *entry.proc);
+    }
+};
+
 
 struct Creature
 {
@@ -342,10 +516,9 @@ struct Creature
     };
 
 
-    struct Neiron
+    struct Neiron  // summed level is kept on stack during execute_step()
     {
         int32_t act_level;
-        int32_t level;
     };
 
     struct Link
@@ -358,38 +531,126 @@ struct Creature
         }
     };
 
+    template<typename T> struct Array  // after creature object in its allocation, capacity is fixed by place()
+    {
+        uint32_t offset, count;  // offset: from this array
+
+        Array() : offset(0), count(0)
+        {
+        }
+
+        Array(const Array &) = delete;
+        Array &operator = (const Array &) = delete;
+
+        static uintptr_t reserve(uintptr_t &pos, uint32_t capacity)  // returns start
+        {
+            static_assert(std::is_trivially_destructible<T>::value, "elements are never destroyed");
+            static_assert(alignof(T) <= alignof(uint64_t), "memory is allocated in words");
+            uintptr_t start = (pos + alignof(T) - 1) & ~uintptr_t(alignof(T) - 1);
+            pos = start + capacity * sizeof(T);  return start;
+        }
+
+        void place(uintptr_t &pos, uint32_t capacity)
+        {
+            offset = reserve(pos, capacity) - reinterpret_cast<uintptr_t>(this);  count = 0;
+        }
+
+        template<typename... Args> void emplace_back(Args &&... args)
+        {
+            new(data() + count++) T(std::forward<Args>(args)...);
+        }
+
+        void push_back(const T &val)
+        {
+            new(data() + count++) T(val);
+        }
+
+        void resize(uint32_t n, const T &val = T())
+        {
+            for(; count < n; count++)new(data() + count) T(val);
+        }
+
+        size_t size() const
+        {
+            return count;
+        }
+
+        T *data()
+        {
+            return reinterpret_cast<T *>(reinterpret_cast<uintptr_t>(this) + offset);
+        }
+
+        const T *data() const
+        {
+            return reinterpret_cast<const T *>(reinterpret_cast<uintptr_t>(this) + offset);
+        }
+
+        T *begin()
+        {
+            return data();
+        }
+
+        const T *begin() const
+        {
+            return data();
+        }
+
+        T *end()
+        {
+            return data() + count;
+        }
+
+        const T *end() const
+        {
+            return data() + count;
+        }
+
+        T &back()
+        {
+            return data()[count - 1];
+        }
+
+        T &operator [] (size_t index)
+        {
+            return data()[index];
+        }
+
+        const T &operator [] (size_t index) const
+        {
+            return data()[index];
+        }
+    };
+
 
     uint64_t id;
-    Genome genome;
+    GenomeRef genome;
 
     Position pos;
-    angle_t angle;
+    angle_t angle;  uint8_t flags;
+    uint32_t size;  // of allocation, object and arrays
     uint64_t energy, max_energy;
     Config::SlotCost passive_cost;
-    mutable std::atomic<uint64_t> food_energy;
+    mutable uint64_t food_energy;  // from credits of eaten food
     uint32_t total_life, max_life, damage, attack_count;
     uint64_t creature_vis_r2[f_creature];
     uint64_t food_vis_r2[2], claw_r2;
     Detector father;
-    uint8_t flags;
 
-    std::vector<Womb> wombs;
-    std::vector<Claw> claws;
-    std::vector<Leg> legs;
-    std::vector<angle_t> rotators;
-    std::vector<Signal> signals;
+    Array<Womb> wombs;  // in single allocation with creature, created by spawn()
+    Array<Claw> claws;
+    Array<Leg> legs;
+    Array<angle_t> rotators;
+    Array<Signal> signals;
 
-    std::vector<Stomach> stomachs;
-    std::vector<Hide> hides;
-    std::vector<Eye> eyes;
-    std::vector<Radar> radars;
+    Array<Stomach> stomachs;
+    Array<Hide> hides;
+    Array<Eye> eyes;
+    Array<Radar> radars;
 
-    std::vector<slot_t> order;
-    std::vector<uint8_t> input;
-    std::vector<Neiron> neirons;
-    std::vector<Link> links;
-
-    Creature *next;
+    Array<uint8_t> input;
+    Array<Neiron> neirons;
+    Array<Link> links;
+    Array<slot_t> order;
 
 
     Creature() = delete;
@@ -399,19 +660,23 @@ struct Creature
     void update_max_visibility(uint8_t vis_flags, uint64_t r2);
     Slot::Type append_slot(const Config &config, const GenomeProcessor::SlotData &slot);
     static void calc_mapping(const GenomeProcessor &proc, std::vector<uint32_t> &mapping);
-    Creature(const Config &config, Genome &genome, const GenomeProcessor &proc,
-        uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy);
-    static Creature *spawn(const Config &config, Genome &genome,
+    static uintptr_t place_arrays(Creature *cr, uintptr_t pos, const GenomeProcessor &proc);
+    static size_t alloc_size(const GenomeProcessor &proc);
+    Creature(const Config &config, const GenomeRef &genome, const GenomeProcessor &proc,
         uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy);
+    static Creature *spawn(const Config &config, const GenomeRef &genome,
+        uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy,
+        CreaturePool *pool = nullptr, BrainCache *brains = nullptr);
     static Creature *spawn(const Config &config, Random &rand, const Creature &parent,
-        uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy);
+        uint64_t id, const Position &pos, angle_t angle, uint64_t spawn_energy,
+        CreaturePool *pool = nullptr, BrainCache *brains = nullptr);
 
     void pre_process(const Config &config);
     void update_view(uint8_t tg_flags, uint64_t r2, angle_t dir);
     void update_damage(const Creature *cr, uint64_t r2, angle_t dir);
     void process_food(const std::vector<Food> &foods);
-    void eat_food(std::vector<Food> &foods) const;
-    void process_detectors(const Creature *cr);
+    void eat_food(const Food *food, Detector *eater, size_t n) const;
+    void process_detectors(const Creature *cr, const Targets &tg, size_t index);  // fields of cr at index
     void post_process(const Config &config);
 
     uint64_t execute_step(const Config &config);
@@ -419,6 +684,43 @@ struct Creature
     static Creature *load(const Config &config, InStream &stream, uint64_t next_id, uint64_t *buf);
     bool load(InStream &stream, uint64_t load_energy, uint64_t *buf);
     void save(OutStream &stream, uint64_t *buf) const;
+
+    static void operator delete(void *ptr)  // allocation size is not sizeof(Creature)
+    {
+        ::operator delete(ptr);
+    }
+};
+
+
+struct CreaturePool  // memory of freed creatures by size class, owned by one group, compatible with plain delete
+{
+    struct Block
+    {
+        Block *next;
+    };
+
+    Block *first[pool_class_count];
+    uint32_t size;  // of free lists
+    uint64_t memory;  // of free lists, in bytes
+    uint64_t fresh, reused;  // allocation counts
+
+
+    CreaturePool() : first{}, size(0), memory(0), fresh(0), reused(0)
+    {
+    }
+
+    CreaturePool(const CreaturePool &) = delete;
+    CreaturePool &operator = (const CreaturePool &) = delete;
+
+    ~CreaturePool()
+    {
+        clear();
+    }
+
+    void *alloc(size_t &bytes);  // multiple of pool_granule
+    void free(Creature *cr);
+    void swap(CreaturePool &pool);
+    void clear();
 };
 
 
@@ -438,9 +740,9 @@ struct TileLayout
 
     struct GroupDesc
     {
-        uint32_t tile_count, ref_count;
+        uint32_t first_tile, tile_count, ref_count;  // first_tile: position in group order
 
-        GroupDesc() : tile_count(0), ref_count(0)
+        GroupDesc() : first_tile(0), tile_count(0), ref_count(0)
         {
         }
     };
@@ -464,8 +766,11 @@ struct TileLayout
     uint32_t size_x, size_y;
     std::vector<TileDesc> tiles;
     std::vector<GroupDesc> groups;
+    std::vector<uint32_t> order;  // tiles in group order
 
-    TileLayout(uint32_t size_x, uint32_t size_y, uint32_t group_count);
+    TileLayout(uint32_t size_x, uint32_t size_y, uint32_t group_count, const uint64_t *cost = nullptr, bool hilbert = false);
+    void hilbert_order();
+    uint32_t ref_total() const;
     void process_tile(TileDesc &cur, const Offsets &offs_x, const Offsets &offs_y);
     void process_line(uint32_t pos, const Offsets &offs_y);
     void build_layout();
@@ -475,23 +780,39 @@ struct TileLayout
 struct FoodData;
 struct CreatureData;
 struct SectorData;
+struct CreatureState;
 struct Context;
 
 struct TileGroup
 {
     typedef TileLayout::Reference Reference;
 
+    struct Source  // end of objects from one tile in buffer
+    {
+        uint32_t tile;  // row-major index
+        uint32_t food_end, creature_end;
+    };
+
     struct TileBuffer
     {
         std::vector<Food> foods;
-        Creature *first, **last;
+        std::vector<Creature *> creatures;
+        std::vector<Source> sources;  // consolidate() merges in source order, independent of layout
         uint32_t food_count, creature_count, attack_count;
 
         void append(Creature *cr)
         {
-            *last = cr;  last = &cr->next;  creature_count++;
+            creatures.push_back(cr);  creature_count++;
             attack_count += cr->attack_count;
         }
+
+        void mark(uint32_t tile);
+        void clear();
+    };
+
+    struct Credit  // food eaten by creature
+    {
+        const Creature *target;
     };
 
     struct Tile : public TileBuffer
@@ -505,13 +826,25 @@ struct TileGroup
         uint32_t spawn_start;
         uint32_t children_count;
         uint64_t id_offset;  // TODO: memory layout
+        uint32_t result_offset;  // in group results if split
+        std::vector<Detector> eaters;  // of foods, reset by process_detectors()
+        std::vector<Creature *> children;  // born in this step, appended by consolidate()
+        std::vector<uint32_t> parts;  // creature index bounds of detector parts
+        std::vector<std::vector<Credit>> credits;  // [9 * part + direction of target tile], collected at the next step
+        Targets targets;  // rebuilt with creature list
 
-        Tile();
         ~Tile();
         void init(const TileLayout::TileDesc &desc);
+        void move(Tile &tile);
+        void clear();
 
+        void consolidate(std::vector<TileGroup> &groups);
+        void split(uint32_t count);
+        void process_detectors(const Config &config, const std::vector<TileGroup> &groups, const Reference &ref,
+            uint32_t first, uint32_t last, size_t food_first, size_t food_last);
         void process_detectors(const Config &config,
-            const std::vector<TileGroup> &groups, const Reference &ref);
+            const std::vector<Reference> &layout, const std::vector<TileGroup> &groups,
+            uint32_t part = 0, uint32_t part_count = 1);
         void update(const Config &config, uint64_t id, const Creature *&sel,
             FoodData *food_buf, CreatureData *creature_buf, SectorData *attack_buf) const;
         bool hit_test(const Position pos, uint64_t max_r2, const Creature *&sel, uint64_t prev_id) const;
@@ -521,20 +854,44 @@ struct TileGroup
     };
 
 
+    struct Part
+    {
+        Creature **first;  // in creatures of tile
+        uint32_t offset, count;  // in results
+    };
+
+    struct StepResult  // of Creature::execute_step() done in parts
+    {
+        Position pos;  angle_t angle;
+        uint64_t dead_energy;
+    };
+
+
     uint64_t next_id;
+    uint32_t first_tile;  // position in group order, for draw offsets
     std::vector<Tile> tiles;
     std::vector<TileBuffer> buffers;
-    Creature *del_queue;
+    std::vector<uint32_t> targets;  // destination tile of every buffer
+    std::vector<Creature *> deleted;  // freed at the next step
+    CreaturePool pool;  // of creatures freed by this group, wherever they were born
+    std::vector<Part> parts;
+    std::vector<StepResult> results;
 
 
+    ~TileGroup();
     void alloc(const TileLayout::GroupDesc &desc);
+    void free_deleted();
+    void relocate();
 
     uint32_t neighbor_index(const Config &config, const Tile &tile, Position &pos);
     void spawn_grass(const Config &config, Tile &tile);
     void spawn_meat(const Config &config, Tile &tile, Position pos, uint64_t energy);
 
-    void execute_step(const Config &config);
-    void consolidate(const std::vector<Reference> &layout, std::vector<TileGroup> &groups);
+    void collect_credits(const Config &config,
+        const std::vector<Reference> &layout, const std::vector<TileGroup> &groups);
+    uint32_t add_parts(Tile &tile, uint32_t count);
+    void execute_part(const Config &config, uint32_t index);
+    uint64_t execute_step(const Config &config, BrainCache &brains);  // returns number of allocated creatures
     void process_detectors(const Config &config,
         const std::vector<Reference> &layout, const std::vector<TileGroup> &groups);
 
@@ -547,39 +904,184 @@ struct TileGroup
 };
 
 
+class Barrier  // sense-reversing, spins before parking
+{
+    std::atomic<uint32_t> count, sleepers;
+    std::atomic<uint8_t> sense;
+    uint32_t total, spin_count;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+
+public:
+    void init(uint32_t n, uint32_t spin);
+
+    bool arrive(uint8_t &local_sense);  // true for the last thread, which should call release()
+    void release(uint8_t local_sense);
+    void wait(uint8_t local_sense);
+};
+
+
+class TaskQueue  // Chase-Lev work-stealing deque of fixed capacity
+{
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    std::vector<std::atomic<uint64_t>> tasks;
+    uint64_t mask;
+
+public:
+    void init(uint32_t size);
+    bool empty() const;
+
+    void push(uint64_t task);  // owner only
+    uint64_t take();  // owner only, newest first
+    uint64_t steal();  // any thread, oldest first
+};
+
+
+struct IdleState  // parked workers, shared by worlds of an ensemble
+{
+    std::atomic<uint32_t> sleepers, active;  // active: contexts with unfinished tasks
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
 struct Context
 {
     typedef TileLayout::Reference Reference;
 
     enum Command
     {
-        c_none, c_step, c_draw, c_stop
+        c_none, c_step, c_draw, c_place, c_stop
+    };
+
+    enum Task : uint64_t  // type, part of a split tile or group and index
+    {
+        t_step = uint64_t(0) << 56, t_step_part = uint64_t(1) << 56, t_resume = uint64_t(2) << 56,
+        t_consolidate = uint64_t(3) << 56, t_detect = uint64_t(4) << 56, t_detect_part = uint64_t(5) << 56,
+        t_ids = uint64_t(6) << 56, t_counts = uint64_t(7) << 56,
+        t_draw = uint64_t(8) << 56, t_type_mask = uint64_t(255) << 56
+    };
+
+    enum Scan
+    {
+        s_ids, s_counts  // totals: children; foods, creatures, attacks
+    };
+
+    struct TileState
+    {
+        std::atomic<uint32_t> consolidate_wait, detect_wait;  // unfinished dependencies
+        std::atomic<uint32_t> part_wait;  // unfinished detector parts
+    };
+
+    struct GroupScan  // prefix sums over groups in tile order
+    {
+        std::atomic<uint32_t> wait[2];  // own total and prefix of previous group
+        std::atomic<uint32_t> tile_wait;  // unconsolidated tiles
+        uint64_t total[4], base[4], prefix[4];
+    };
+
+    struct alignas(64) Worker
+    {
+        TaskQueue queue;
+        std::atomic<uint64_t> sync_time;  // in nanoseconds, updated after release
+        std::atomic<uint64_t> local_allocs, remote_allocs;  // creatures, relative to group owner node
+        uint32_t node;
+        uint8_t cmd_sense;
+    };
+
+    struct MemoryUsage  // in bytes, heap overhead is estimated
+    {
+        struct Bytes
+        {
+            uint64_t food_count, creature_count;
+            uint64_t tiles, foods;  // tiles: tile objects and lists, foods: with eaters
+            uint64_t objects, genomes, brains, overhead;  // of creatures, overhead: heap and pool
+            uint64_t cache;  // brain cache table, processors and genomes no creature uses
+
+            uint64_t total() const
+            {
+                return tiles + foods + objects + genomes + brains + overhead + cache;
+            }
+        };
+
+        uint64_t tile_count;
+        uint32_t largest_tile;  // row-major index
+        Bytes world, largest;  // largest: of tile with most bytes, including genomes shared with other tiles
     };
 
     Config config;
     std::vector<Reference> layout;
     std::vector<TileGroup> groups;
+    BrainCache brains;  // of current config
 
     FoodData *food_buf;
     CreatureData *creature_buf;
     SectorData *attack_buf;
-    std::vector<size_t> food_offs, creature_offs, attack_offs;
-    uint64_t current_time, sel_id;
+    std::vector<size_t> food_offs, creature_offs, attack_offs;  // by tile position in group order
+    uint64_t current_time, sel_id, count_time;  // count_time: when offsets were last computed
     const Creature *sel;
-
-    std::mutex mutex;
-    std::condition_variable cond_cmd, cond_work;
-    uint32_t stage;  Command cmd;
+    CreatureState *sel_state;
+    bool draw_step;  // extract draw data before execute_step
+
+    uint32_t thread_count, spin_count, split_size;  // split_size: creatures per part of hot tiles
+    bool wavefront, pipelined;  // overlap consecutive steps of run(), in the current command
+    bool hilbert;  // groups follow Hilbert curve instead of rows
+    std::vector<Worker> workers;
+    std::vector<TileState> tile_state;
+    std::vector<std::atomic<uint32_t>> part_wait;  // unfinished parts of every group
+    std::vector<std::atomic<uint32_t>> group_wait;  // wavefront: detectors around group and step before last
+    std::vector<uint64_t> group_time;  // step of the last execute_step() of every group
+    std::atomic<int32_t> part_budget[2];  // extra tasks left in the step, by step parity
+    std::atomic<uint32_t> task_count[2];
+    std::atomic<uint32_t> generation;  // incremented at step end
+    uint64_t step_count, end_time;  std::function<bool()> until;
+    bool running, stopped;
+    std::chrono::steady_clock::time_point finish_time;  // of the last task command
+    IdleState idle_state, *idle;
+
+    std::vector<GroupScan> group_scan;
+
+    Barrier cmd_barrier;
+    uint8_t cmd_sense;  Command cmd;
+
+    void reset_tile(uint32_t index);
+    void push_tasks(uint32_t index, uint64_t type);
+    void reset_step();
+    void end_tasks(uint32_t index, uint32_t parity);
+    void push_task(uint32_t index, uint64_t task);
+    void release(uint32_t index, std::atomic<uint32_t> &wait, uint64_t task);
+    void wake(bool all);
+    bool has_tasks() const;
+    uint64_t find_task(uint32_t index);
+    bool next_generation(uint32_t index, uint32_t &gen);
+
+    uint32_t owner(uint32_t group) const;
+    void place_groups(uint32_t index);
+
+    void scan(uint32_t index, uint32_t group, Scan type);
+    void assign_ids(uint32_t index, uint32_t group);
+    void count_tiles(uint32_t index, uint32_t group);
+    void release_group(uint32_t index, uint32_t group);
+    void finish_detect(uint32_t index, uint32_t tile);
+    uint32_t split_parts(uint32_t creature_count, uint32_t parity);
+    uint32_t task_parity(uint64_t task) const;
+    void execute_task(uint32_t index, uint64_t task);
+    void run_tasks(uint32_t index);
 
     void start();
-    void pre_execute();
-    void post_execute(Command new_cmd);
+    void prepare(Command new_cmd);
+    void begin(Command new_cmd);
+    void finish();
     void execute(Command new_cmd);
-
-    Command first_wait(uint32_t &target);
-    void barrier(uint32_t &target);
-    Command end_step(uint32_t &target);
-    Command end_draw(uint32_t &target, const Creature *cr);
+    uint64_t sync_time() const;
+    void alloc_counts(uint64_t &local, uint64_t &remote) const;
+    void pool_counts(uint64_t &fresh, uint64_t &reused, uint64_t &cached) const;
+    void memory_usage(MemoryUsage &usage) const;
+
+    void add_sync_time(Worker &worker, std::chrono::steady_clock::time_point start);
+    Command wait_command(uint32_t index);
+    void end_command(uint32_t index);
 };
 
 
@@ -589,25 +1091,36 @@ struct World : public Context
     typedef TileGroup::Tile Tile;
 
 
-    uint32_t group_count;
+    uint32_t group_count, rebalance_period;
     std::vector<std::thread> threads;
+    bool pin_threads, stepping;
 
 
-    World(uint32_t group_count);
+    explicit World(uint32_t thread_count = 0, uint32_t group_count = 0);
     ~World();
 
-    void init();
-    void build_layout();
+    static uint32_t default_thread_count();
+
+    void init(uint64_t seed = 1234, uint8_t order = 6);
+    void build_layout(const uint64_t *cost = nullptr);
+    void rebalance();
 
     void start();
+    void start_step();
+    bool finish_step();
     void next_step();
+    uint64_t run(uint64_t n, const std::function<bool()> &until = nullptr);
     void stop();
 
     void count_objects();
     const Creature *update(FoodData *food_buf, CreatureData *creature_buf, SectorData *attack_buf, uint64_t sel_id);
+    void start_step(FoodData *food_buf, CreatureData *creature_buf, SectorData *attack_buf,
+        uint64_t sel_id, CreatureState &sel);
     const Creature *hit_test(const Position &pos, uint32_t rad, uint64_t prev_id) const;
 
     bool load(InStream &stream);
+    void save_header(OutStream &stream) const;
+    void save_tiles(OutStream &stream, uint32_t first, uint32_t last) const;
     void save(OutStream &stream) const;
 
     size_t food_total() const
@@ -629,4 +1142,40 @@ struct World : public Context
     {
         return groups[layout[index].group].tiles[layout[index].index];
     }
+
+    Tile &get_tile(uint32_t index)
+    {
+        return groups[layout[index].group].tiles[layout[index].index];
+    }
 };
+
+
+struct Ensemble  // independent worlds sharing one worker pool
+{
+    std::vector<std::unique_ptr<World>> worlds;
+    std::vector<uint64_t> steps;  std::vector<double> elapsed;  // per world, time until its last step
+    uint32_t thread_count, spin_count;
+    std::vector<std::thread> threads;
+    IdleState idle;
+
+    Barrier cmd_barrier;
+    uint8_t cmd_sense;  Context::Command cmd;
+
+
+    explicit Ensemble(uint32_t thread_count = 0);
+    ~Ensemble();
+
+    World &add(uint32_t group_count = 0);  // init or load before start()
+
+    void start();
+    void run(uint64_t n);
+    void stop();
+
+    void sync(uint8_t &local_sense);
+    void execute(Context::Command new_cmd);
+    void run_tasks(uint32_t index, std::vector<uint32_t> &gen);
+    static void thread_proc(Ensemble *ensemble, uint32_t index);
+};
+
+
+void print_checksum(const World &world, const OutStream &stream);